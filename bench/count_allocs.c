@@ -0,0 +1,83 @@
+/*
+ * LD_PRELOAD shim used by the benchmarks. Counts calls to malloc and
+ * friends and to mmap, mprotect and munmap, and prints them at exit
+ * together with the number of live mappings and the resident set size.
+ * glibc only.
+ *
+ *   LD_PRELOAD=obj/libcount_allocs.so ./bin/inhu script.inhu
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+extern void* __libc_malloc(size_t Size);
+extern void* __libc_calloc(size_t N, size_t Size);
+extern void* __libc_realloc(void* Ptr, size_t Size);
+
+static atomic_ulong Mallocs, Mmaps, Mprotects, Munmaps;
+
+void* malloc(size_t Size) {
+    atomic_fetch_add_explicit(&Mallocs, 1, memory_order_relaxed);
+    return __libc_malloc(Size);
+}
+
+void* calloc(size_t N, size_t Size) {
+    atomic_fetch_add_explicit(&Mallocs, 1, memory_order_relaxed);
+    return __libc_calloc(N, Size);
+}
+
+void* realloc(void* Ptr, size_t Size) {
+    atomic_fetch_add_explicit(&Mallocs, 1, memory_order_relaxed);
+    return __libc_realloc(Ptr, Size);
+}
+
+void* mmap(void* Addr, size_t Len, int Prot, int Flags, int Fd, off_t Off) {
+    static void* (*Next)(void*, size_t, int, int, int, off_t);
+    if (!Next)
+        Next = dlsym(RTLD_NEXT, "mmap");
+    atomic_fetch_add_explicit(&Mmaps, 1, memory_order_relaxed);
+    return Next(Addr, Len, Prot, Flags, Fd, Off);
+}
+
+int mprotect(void* Addr, size_t Len, int Prot) {
+    static int (*Next)(void*, size_t, int);
+    if (!Next)
+        Next = dlsym(RTLD_NEXT, "mprotect");
+    atomic_fetch_add_explicit(&Mprotects, 1, memory_order_relaxed);
+    return Next(Addr, Len, Prot);
+}
+
+int munmap(void* Addr, size_t Len) {
+    static int (*Next)(void*, size_t);
+    if (!Next)
+        Next = dlsym(RTLD_NEXT, "munmap");
+    atomic_fetch_add_explicit(&Munmaps, 1, memory_order_relaxed);
+    return Next(Addr, Len);
+}
+
+__attribute__((destructor)) static void report(void) {
+    unsigned long Mappings = 0, RSS = 0;
+    char Line[512];
+    FILE* F = fopen("/proc/self/maps", "r");
+    if (F) {
+        while (fgets(Line, sizeof(Line), F))
+            Mappings += strchr(Line, '\n') != NULL;
+        fclose(F);
+    }
+    F = fopen("/proc/self/status", "r");
+    if (F) {
+        while (fgets(Line, sizeof(Line), F))
+            if (sscanf(Line, "VmRSS: %lu kB", &RSS) == 1)
+                break;
+        fclose(F);
+    }
+    fprintf(stderr,
+            "count_allocs: %lu mallocs, %lu mmap, %lu mprotect, %lu munmap, "
+            "%lu live mappings, VmRSS %lu kB\n",
+            atomic_load(&Mallocs), atomic_load(&Mmaps),
+            atomic_load(&Mprotects), atomic_load(&Munmaps), Mappings, RSS);
+}
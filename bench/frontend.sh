@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# Parse and codegen throughput on a generated script of many definitions
+# (100k by default). Runs at -O0 on a single thread, so neither the
+# optimizer nor the codegen pool hides the frontend, and counts mallocs.
+#
+# With git revisions after the count, each one is built in its own worktree
+# under obj/ and run on the same script, e.g. the unique_ptr tree, the bump
+# arena and the flat pool. Revisions older than the -O and -j options run
+# with the pipeline they had.
+#
+#   bench/frontend.sh 100000 7252319^ 7252319 HEAD
+#
+#   make bench          or          bench/frontend.sh [definitions [rev...]]
+set -e
+cd "$(dirname "$0")/.."
+. bench/revisions.sh
+DEFS=${1:-100000}
+shift || true
+SCRIPT=$(mktemp --suffix=.inhu)
+trap 'rm -f "$SCRIPT"' EXIT
+python3 bench/gen_defs.py "$DEFS" > "$SCRIPT"
+
+# run LABEL TREE: the inhu built in TREE
+run() {
+    local OPTS
+    OPTS=$(bench_options "$2")
+    echo "frontend: $1, $DEFS definitions, ${OPTS:-default options}"
+    time LD_PRELOAD=obj/libcount_allocs.so "$2/bin/inhu" $OPTS "$SCRIPT"
+}
+
+if [ $# -eq 0 ]; then
+    run "working tree" .
+    exit
+fi
+for REV in "$@"; do
+    TREE=$(bench_tree "$REV")
+    run "$REV" "$TREE"
+done
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+"""
+Generate an INHU script of many small definitions for the benchmarks.
+
+Each definition takes two arguments and has a depth-3 if/else body of
+about 30 expression nodes. With --calls N, N top-level expressions follow
+that together call every definition once.
+"""
+import argparse
+import sys
+
+
+def body(depth, i):
+    if depth == 0:
+        return f"(a + {i % 7}) * b - a / (b + 1)"
+    inner = body(depth - 1, i + depth)
+    return (f"if a < {i % 11 + depth} then {inner} "
+            f"else {body(depth - 1, i * 3 + depth)}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("defs", type=int, help="number of definitions")
+    parser.add_argument("--calls", type=int, default=0,
+                        help="top-level expressions calling the definitions")
+    args = parser.parse_args()
+
+    out = sys.stdout
+    for i in range(args.defs):
+        out.write(f"def f{i}(a, b) as\n    {body(3, i)};\n")
+
+    if args.calls:
+        per_call = -(-args.defs // args.calls)
+        for start in range(0, args.defs, per_call):
+            terms = " + ".join(f"f{i}({i % 5}, 2)"
+                               for i in range(start,
+                                              min(start + per_call, args.defs)))
+            out.write(terms + ";\n")
+
+
+if __name__ == "__main__":
+    main()
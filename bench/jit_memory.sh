@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+# Memory the JIT maps for many small modules: 10k generated definitions
+# (by default), all called from 100 top-level expressions, at -O0 on a
+# single thread. Reports mmap/mprotect/munmap calls, live mappings and RSS
+# at exit.
+#
+# With git revisions after the count, each one is built in its own worktree
+# under obj/ and run on the same script, e.g. RTDyld with a
+# SectionMemoryManager per object against JITLink with the slab manager:
+#
+#   bench/jit_memory.sh 10000 8a9bbb7^ 8a9bbb7
+#
+#   make bench          or          bench/jit_memory.sh [definitions [rev...]]
+set -e
+cd "$(dirname "$0")/.."
+. bench/revisions.sh
+DEFS=${1:-10000}
+shift || true
+SCRIPT=$(mktemp --suffix=.inhu)
+trap 'rm -f "$SCRIPT"' EXIT
+python3 bench/gen_defs.py "$DEFS" --calls 100 > "$SCRIPT"
+
+# run LABEL TREE: the inhu built in TREE
+run() {
+    local OPTS
+    OPTS=$(bench_options "$2")
+    echo "jit memory: $1, $DEFS definitions, 100 expressions," \
+         "${OPTS:-default options}"
+    LD_PRELOAD=obj/libcount_allocs.so "$2/bin/inhu" $OPTS "$SCRIPT" 2>&1 |
+        grep -v '^Evaluated to'
+}
+
+if [ $# -eq 0 ]; then
+    run "working tree" .
+    exit
+fi
+for REV in "$@"; do
+    TREE=$(bench_tree "$REV")
+    run "$REV" "$TREE"
+done
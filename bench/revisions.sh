@@ -0,0 +1,24 @@
+# Helpers for benchmarks that compare git revisions, sourced from the
+# repository root.
+
+# bench_tree REV: a worktree under obj/ with REV checked out and built.
+# Prints its path.
+bench_tree() {
+    local HASH TREE
+    HASH=$(git rev-parse --short "$1")
+    TREE=obj/bench-$HASH
+    if [ ! -x "$TREE/bin/inhu" ]; then
+        git worktree prune
+        rm -rf "$TREE"
+        git worktree add --detach "$TREE" "$HASH" > /dev/null
+        make -C "$TREE" -j"$(nproc)" > /dev/null
+    fi
+    echo "$TREE"
+}
+
+# bench_options TREE: the -O0 -j1 options the inhu in TREE understands
+bench_options() {
+    grep -q '"-O0"' "$1/src/main.cpp" && echo -n "-O0 "
+    grep -q 'consume_front("-j")' "$1/src/main.cpp" && echo -n "-j1"
+    return 0
+}
@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+# Regression benchmark for self tail calls: bench/tailrec.inhu recurses a
+# million levels deep. Runs it at -O0 and -O2 and fails if either run
+# crashes or prints wrong results.
+#
+#   make bench          or          bench/tailrec.sh
+set -e
+cd "$(dirname "$0")/.."
+EXPECTED="Evaluated to 1000000.000000
+Evaluated to 1000000.500000
+Evaluated to 1.000000"
+
+for OPT in -O0 -O2; do
+    echo "tailrec: $OPT"
+    OUT=$( { time ./bin/inhu "$OPT" bench/tailrec.inhu; } 2>&1 )
+    if [ "$(grep '^Evaluated to' <<< "$OUT")" != "$EXPECTED" ]; then
+        echo "$OUT"
+        echo "tailrec: wrong results at $OPT" >&2
+        exit 1
+    fi
+    grep -v '^Evaluated to' <<< "$OUT"
+done
@@ -15,15 +15,22 @@
 
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCEHFrameRegistrar.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
-#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/MapperJITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/MemoryMapper.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
 #include <memory>
@@ -37,60 +44,165 @@ namespace llvm {
 
             DataLayout DL;
             MangleAndInterner Mangle;
+            JITTargetMachineBuilder JTMB;
 
-            RTDyldObjectLinkingLayer ObjectLayer;
+            ObjectLinkingLayer ObjectLayer;
             IRCompileLayer CompileLayer;
 
+            // optimizes each function in lazy mode, and each module added
+            // without a tracker otherwise, right before it is compiled
+            // (identity unless setOptimizer is called)
+            IRTransformLayer OptimizeLayer;
+
+            // only set up in lazy mode: stubs and lazy call-throughs that
+            // compile each function the first time it is called
+            std::unique_ptr<EPCIndirectionUtils> EPCIU;
+            std::unique_ptr<CompileOnDemandLayer> CODLayer;
+
             JITDylib &MainJD;
 
+            // address space reserved at a time for JIT'd code and data
+            static constexpr size_t SlabSize = 64 * 1024 * 1024;
+
+            static void handleLazyCallThroughError() {
+                errs() << "LazyCallThrough error: Could not find function body";
+                exit(1);
+            }
+
         public:
             KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                            JITTargetMachineBuilder JTMB, DataLayout DL)
+                            JITTargetMachineBuilder JTMB, DataLayout DL,
+                            std::unique_ptr<jitlink::JITLinkMemoryManager> MemMgr,
+                            std::unique_ptr<EPCIndirectionUtils> EPCIU = nullptr,
+                            ObjectCache *Cache = nullptr)
                     : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-                      ObjectLayer(*this->ES,
-                                  []() { return std::make_unique<SectionMemoryManager>(); }),
+                      JTMB(JTMB),
+                      ObjectLayer(*this->ES, std::move(MemMgr)),
                       CompileLayer(*this->ES, ObjectLayer,
-                                   std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                                   std::make_unique<ConcurrentIRCompiler>(std::move(JTMB), Cache)),
+                      OptimizeLayer(*this->ES, CompileLayer),
+                      EPCIU(std::move(EPCIU)),
                       MainJD(this->ES->createBareJITDylib("<main>")) {
                 MainJD.addGenerator(
                         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
                                 DL.getGlobalPrefix())));
-                if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
-                    ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-                    ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
-                }
+                // register unwind info of JIT'd code, if the process supports it
+                if (auto Registrar = EPCEHFrameRegistrar::Create(*this->ES))
+                    ObjectLayer.addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+                            *this->ES, std::move(*Registrar)));
+                else
+                    consumeError(Registrar.takeError());
+                if (this->EPCIU)
+                    CODLayer = std::make_unique<CompileOnDemandLayer>(
+                            *this->ES, OptimizeLayer,
+                            this->EPCIU->getLazyCallThroughManager(),
+                            [this] { return this->EPCIU->createIndirectStubsManager(); });
             }
 
             ~KaleidoscopeJIT() {
                 if (auto Err = ES->endSession())
                     ES->reportError(std::move(Err));
+                if (EPCIU)
+                    if (auto Err = EPCIU->cleanup())
+                        ES->reportError(std::move(Err));
             }
 
-            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-                auto EPC = SelfExecutorProcessControl::Create();
+            static Expected<std::unique_ptr<KaleidoscopeJIT>>
+            Create(CodeGenOpt::Level OptLevel = CodeGenOpt::Default,
+                   bool Lazy = false, bool Concurrent = false,
+                   ObjectCache *Cache = nullptr, StringRef CPU = "",
+                   StringRef Features = "") {
+                // with a thread pool dispatcher independent modules are
+                // compiled on separate threads
+                std::unique_ptr<TaskDispatcher> D;
+                if (Concurrent)
+                    D = std::make_unique<DynamicThreadPoolTaskDispatcher>();
+                auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(D));
                 if (!EPC)
                     return EPC.takeError();
 
                 auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
+                std::unique_ptr<EPCIndirectionUtils> EPCIU;
+                if (Lazy) {
+                    auto IU = EPCIndirectionUtils::Create(
+                            ES->getExecutorProcessControl());
+                    if (!IU)
+                        return IU.takeError();
+                    EPCIU = std::move(*IU);
+                    EPCIU->createLazyCallThroughManager(
+                            *ES, ExecutorAddr::fromPtr(&handleLazyCallThroughError));
+                    if (auto Err = setUpInProcessLCTMReentryViaEPCIU(*EPCIU))
+                        return std::move(Err);
+                }
+
+                // code runs on this machine, so by default tune it for the
+                // host CPU and use all of its features. A CPU named
+                // explicitly brings only its own features, plus Features
+                // (e.g. "+avx2,-avx512f") either way.
                 JITTargetMachineBuilder JTMB(
                         ES->getExecutorProcessControl().getTargetTriple());
+                if (CPU.empty() || CPU == "native") {
+                    auto Host = JITTargetMachineBuilder::detectHost();
+                    if (!Host)
+                        return Host.takeError();
+                    JTMB = std::move(*Host);
+                } else {
+                    JTMB.setCPU(CPU.str());
+                }
+                if (!Features.empty())
+                    JTMB.addFeatures(SubtargetFeatures(Features).getFeatures());
+                JTMB.setCodeGenOptLevel(OptLevel);
+
+                // JITLink places code anywhere in the address space
+                JTMB.setRelocationModel(Reloc::PIC_);
+                JTMB.setCodeModel(CodeModel::Small);
+
+                // reserve address space in large slabs and pack the sections
+                // of many small objects into them, instead of mapping pages
+                // for every object
+                auto MemMgr = MapperJITLinkMemoryManager::CreateWithMapper<
+                        InProcessMemoryMapper>(SlabSize);
+                if (!MemMgr)
+                    return MemMgr.takeError();
 
                 auto DL = JTMB.getDefaultDataLayoutForTarget();
                 if (!DL)
                     return DL.takeError();
 
                 return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                                         std::move(*DL));
+                                                         std::move(*DL), std::move(*MemMgr),
+                                                         std::move(EPCIU), Cache);
             }
 
             const DataLayout &getDataLayout() const { return DL; }
 
+            // a TargetMachine for the JIT's target, e.g. for the optimizer's
+            // cost models. It is not thread-safe, so each thread needs its own.
+            Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+                return JTMB.createTargetMachine();
+            }
+
             JITDylib &getMainJITDylib() { return MainJD; }
 
+            // IR transform run on each function in lazy mode, and on each
+            // module added without a tracker otherwise, right before it is
+            // compiled
+            void setOptimizer(IRTransformLayer::TransformFunction Transform) {
+                OptimizeLayer.setTransform(std::move(Transform));
+            }
+
             Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
-                if (!RT)
+                // in lazy mode only stubs are emitted here and each function
+                // is compiled on its first call. Modules with their own
+                // tracker are run right away and removed, so they are
+                // optimized by the caller and compiled directly.
+                if (!RT) {
                     RT = MainJD.getDefaultResourceTracker();
+                    if (CODLayer)
+                        return CODLayer->add(RT, std::move(TSM));
+                    return OptimizeLayer.add(RT, std::move(TSM));
+                }
                 return CompileLayer.add(RT, std::move(TSM));
             }
 
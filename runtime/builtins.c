@@ -0,0 +1,72 @@
+/*
+ * Runtime library of INHU programs. It is linked into the inhu binary, where
+ * the JIT resolves calls against it, and shipped as lib/libinhurt.a for
+ * programs compiled ahead of time.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/* library functions that can be 'extern'd from user code */
+
+DLLEXPORT double putchard(double X) {
+    fputc((char)X, stderr);
+    return 0;
+}
+
+DLLEXPORT double printd(double X) {
+    fprintf(stderr, "%f\n", X);
+    return 0;
+}
+
+/* arrays: the length, followed by the elements */
+struct inhu_array {
+    int64_t len;
+    double data[];
+};
+
+/* array(N): N elements set to 0, living until free(A) */
+DLLEXPORT struct inhu_array* __inhu_array_new(double N) {
+    /* the size in bytes has to fit a size_t, which also keeps the
+       conversion to int64_t defined. Lengths below 2^53 are exact doubles,
+       which compiled code takes len() to be. */
+    const size_t MaxLen = (SIZE_MAX - sizeof(struct inhu_array)) /
+                          sizeof(double);
+    if (!isfinite(N) || N >= (double)MaxLen || N >= 0x1p53) {
+        fprintf(stderr, "Error: cannot allocate an array of %g elements\n", N);
+        exit(1);
+    }
+    int64_t Len = N >= 1 ? (int64_t)N : 0;
+    struct inhu_array* A = calloc(1, sizeof(*A) + Len * sizeof(double));
+    if (!A) {
+        fprintf(stderr, "Error: cannot allocate an array of %lld elements\n",
+                (long long)Len);
+        exit(1);
+    }
+    A->len = Len;
+    return A;
+}
+
+/* free(A): A must not be used afterwards */
+DLLEXPORT void __inhu_array_free(struct inhu_array* A) {
+    free(A);
+}
+
+/* called by compiled code on an out-of-bounds or NaN array index */
+DLLEXPORT void __inhu_bounds_error(double Index, int64_t Len) {
+    fprintf(stderr, "Error: index %.17g out of bounds for array of length %lld\n",
+            Index, (long long)Len);
+    exit(1);
+}
+
+/* called by compiled programs with the value of each top-level expression */
+DLLEXPORT void __inhu_print_result(double X) {
+    fprintf(stderr, "Evaluated to %f\n", X);
+}
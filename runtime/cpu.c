@@ -0,0 +1,39 @@
+/*
+ * CPU detection for definitions compiled in several versions. Their first
+ * call picks the version for the best x86-64 level the CPU supports.
+ */
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/*
+ * x86-64 microarchitecture level of the CPU: 1 for the baseline, up to 4
+ * for AVX-512. The features checked are the ones the compiler makes use of
+ * at each level; the others always come along with them. 0 elsewhere.
+ */
+DLLEXPORT int __inhu_cpu_level(void) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (!(__builtin_cpu_supports("popcnt") &&
+          __builtin_cpu_supports("ssse3") &&
+          __builtin_cpu_supports("sse4.1") &&
+          __builtin_cpu_supports("sse4.2")))
+        return 1;
+    /* also tells whether the OS saves the AVX registers */
+    if (!(__builtin_cpu_supports("avx") && __builtin_cpu_supports("avx2") &&
+          __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi") &&
+          __builtin_cpu_supports("bmi2")))
+        return 2;
+    if (!(__builtin_cpu_supports("avx512f") &&
+          __builtin_cpu_supports("avx512vl") &&
+          __builtin_cpu_supports("avx512bw") &&
+          __builtin_cpu_supports("avx512dq") &&
+          __builtin_cpu_supports("avx512cd")))
+        return 3;
+    return 4;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,199 @@
+/*
+ * Thread pool behind 'parallel for'. The iterations of a loop are split
+ * evenly over the threads up front. Each thread runs its own share in
+ * chunks, and a thread that runs out takes over the upper half of the
+ * iterations another thread has left.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/* outlined loop body, running iterations [lo, hi) */
+typedef void (*inhu_body_fn)(int64_t lo, int64_t hi, void* env);
+
+/* chunks each thread's share is cut into, so stolen work is balanced */
+#define CHUNKS_PER_THREAD 16
+
+/* iterations not started yet by one thread */
+struct range {
+    pthread_mutex_t lock;
+    int64_t lo, hi;
+};
+
+static struct {
+    pthread_mutex_t lock; /* guards everything below but the ranges */
+    pthread_cond_t wake;  /* a new loop started */
+    pthread_cond_t done;  /* a worker left the loop */
+    int num_threads;      /* including the thread starting a loop */
+    int started;
+    unsigned long generation;
+    int active; /* workers taking part in the current loop */
+
+    inhu_body_fn body;
+    void* env;
+    int64_t chunk;
+    struct range* ranges; /* one per thread, the starting thread's first */
+    atomic_int_fast64_t remaining;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+          PTHREAD_COND_INITIALIZER};
+
+/* one loop runs on the pool at a time */
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* set on threads running loop bodies: loops nested in them run serially */
+static _Thread_local int in_loop;
+
+static int take_chunk(struct range* r, int64_t* lo, int64_t* hi) {
+    pthread_mutex_lock(&r->lock);
+    int found = r->lo < r->hi;
+    if (found) {
+        *lo = r->lo;
+        *hi = r->hi - r->lo > pool.chunk ? r->lo + pool.chunk : r->hi;
+        r->lo = *hi;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return found;
+}
+
+/* move the upper half of another thread's iterations to this one */
+static int steal(int self) {
+    for (int i = 1; i < pool.num_threads; ++i) {
+        struct range* victim = &pool.ranges[(self + i) % pool.num_threads];
+        pthread_mutex_lock(&victim->lock);
+        int64_t left = victim->hi - victim->lo;
+        if (left <= 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        int64_t lo = victim->hi - (left + 1) / 2, hi = victim->hi;
+        victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+
+        struct range* own = &pool.ranges[self];
+        pthread_mutex_lock(&own->lock);
+        own->lo = lo;
+        own->hi = hi;
+        pthread_mutex_unlock(&own->lock);
+        return 1;
+    }
+    return 0;
+}
+
+static void run_chunks(int self) {
+    int64_t lo, hi;
+    while (take_chunk(&pool.ranges[self], &lo, &hi) ||
+           (steal(self) && take_chunk(&pool.ranges[self], &lo, &hi))) {
+        pool.body(lo, hi, pool.env);
+        atomic_fetch_sub(&pool.remaining, hi - lo);
+    }
+}
+
+static void* worker_main(void* arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    in_loop = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        seen = pool.generation;
+        ++pool.active;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_chunks(self);
+
+        pthread_mutex_lock(&pool.lock);
+        --pool.active;
+        pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+/* called with pool.lock held */
+static void start_pool(void) {
+    pool.started = 1;
+    if (!pool.num_threads) {
+        const char* env = getenv("INHU_NUM_THREADS");
+        pool.num_threads = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (pool.num_threads < 1)
+        pool.num_threads = 1;
+
+    pool.ranges = calloc(pool.num_threads, sizeof(*pool.ranges));
+    for (int i = 0; i < pool.num_threads; ++i)
+        pthread_mutex_init(&pool.ranges[i].lock, NULL);
+
+    /* workers sleep between loops and live as long as the program */
+    for (int i = 1; i < pool.num_threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, (void*)(intptr_t)i)) {
+            pool.num_threads = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/* threads used by parallel loops, if called before the first one runs.
+ * Defaults to $INHU_NUM_THREADS, or one per core. */
+DLLEXPORT void __inhu_set_num_threads(int n) {
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.started)
+        pool.num_threads = n;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* run body over iterations [0, n) on the pool and wait for all of them */
+DLLEXPORT void __inhu_parallel_for(int64_t n, inhu_body_fn body, void* env) {
+    if (n <= 0)
+        return;
+
+    /* nested loops, and loops started while another one runs, run serially */
+    if (in_loop || pthread_mutex_trylock(&loop_lock)) {
+        body(0, n, env);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.started)
+        start_pool();
+
+    /* workers that joined the previous loop late still look at its ranges */
+    while (pool.active)
+        pthread_cond_wait(&pool.done, &pool.lock);
+
+    int threads = pool.num_threads;
+    pool.body = body;
+    pool.env = env;
+    pool.chunk = n / ((int64_t)threads * CHUNKS_PER_THREAD);
+    if (pool.chunk < 1)
+        pool.chunk = 1;
+    for (int i = 0; i < threads; ++i) {
+        pool.ranges[i].lo = n * i / threads;
+        pool.ranges[i].hi = n * (i + 1) / threads;
+    }
+    atomic_store(&pool.remaining, n);
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    in_loop = 1;
+    run_chunks(0);
+    in_loop = 0;
+
+    /* join: chunks still running belong to workers that are active */
+    pthread_mutex_lock(&pool.lock);
+    while (atomic_load(&pool.remaining) || pool.active)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&loop_lock);
+}
@@ -0,0 +1,170 @@
+#include "aot.hpp"
+#include "driver.hpp"
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <string>
+
+using namespace llvm;
+
+/**
+ * @brief Target machine for the host, producing position-independent code
+ * so the objects link into default (PIE) executables. The code runs on any
+ * CPU of the host's architecture unless --mcpu names one, with 'native'
+ * standing for the host CPU and all of its features.
+ */
+static std::unique_ptr<TargetMachine> CreateHostTargetMachine() {
+    std::string CPU = Options.CPU ? Options.CPU : "generic";
+    std::string Triple = sys::getProcessTriple();
+    std::string Err;
+    const Target* T = TargetRegistry::lookupTarget(Triple, Err);
+    if (!T) {
+        fprintf(stderr, "Error: %s\n", Err.c_str());
+        return nullptr;
+    }
+
+    SubtargetFeatures Features;
+    if (CPU == "native") {
+        auto Host = ExitOnErr(orc::JITTargetMachineBuilder::detectHost());
+        CPU = Host.getCPU();
+        Features = Host.getFeatures();
+    }
+    if (Options.Features)
+        for (const std::string &Feature :
+             SubtargetFeatures(Options.Features).getFeatures())
+            Features.AddFeature(Feature);
+    return std::unique_ptr<TargetMachine>(T->createTargetMachine(
+            Triple, CPU, Features.getString(), TargetOptions(), Reloc::PIC_,
+            std::nullopt, GetCodeGenOptLevel()));
+}
+
+/**
+ * @brief Add main(), which runs the thunks in order and prints each result
+ * the same way the JIT does
+ */
+static bool EmitMain(const std::vector<Symbol> &Thunks) {
+    if (TheModule->getFunction("main")) {
+        LogErrorV("'main' is reserved in compiled programs");
+        return false;
+    }
+
+    Function* Main = Function::Create(
+            FunctionType::get(Builder->getInt32Ty(), false),
+            Function::ExternalLinkage, "main", TheModule.get());
+    FunctionCallee PrintResult = TheModule->getOrInsertFunction(
+            "__inhu_print_result", Builder->getVoidTy(),
+            Builder->getDoubleTy());
+
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Main));
+    for (Symbol Name : Thunks) {
+        Function* Thunk = TheModule->getFunction(Symbols.name(Name));
+        Thunk->setLinkage(GlobalValue::InternalLinkage);
+        Builder->CreateCall(PrintResult, Builder->CreateCall(Thunk));
+    }
+    Builder->CreateRet(Builder->getInt32(0));
+    return !verifyFunction(*Main, &errs());
+}
+
+/**
+ * @brief Run the backend over the current module and write the object file
+ */
+static bool WriteObjectFile(TargetMachine &TM, StringRef Path) {
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", Path.str().c_str(),
+                EC.message().c_str());
+        return false;
+    }
+
+    legacy::PassManager PM;
+    if (TM.addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile)) {
+        fprintf(stderr, "Error: target cannot emit object files\n");
+        return false;
+    }
+    PM.run(*TheModule);
+    OS.flush();
+    return !OS.has_error();
+}
+
+/**
+ * @brief Link an object file with the runtime library into an executable,
+ * using the system C compiler driver
+ */
+static bool LinkExecutable(const char* Argv0, StringRef ObjPath,
+                           StringRef ExePath) {
+    // the runtime library is installed next to the binary: bin/../lib
+    static int Anchor;
+    SmallString<256> RuntimeLib(sys::fs::getMainExecutable(Argv0, &Anchor));
+    sys::path::remove_filename(RuntimeLib);
+    sys::path::append(RuntimeLib, "..", "lib", "libinhurt.a");
+    if (!sys::fs::exists(RuntimeLib)) {
+        fprintf(stderr, "Error: runtime library '%s' not found\n",
+                RuntimeLib.c_str());
+        return false;
+    }
+
+    auto CC = sys::findProgramByName("cc");
+    if (!CC) {
+        fprintf(stderr, "Error: no C compiler driver 'cc' to link with\n");
+        return false;
+    }
+
+    StringRef Args[] = {*CC, ObjPath, RuntimeLib, "-lm", "-lpthread", "-o",
+                        ExePath};
+    std::string ErrMsg;
+    if (sys::ExecuteAndWait(*CC, Args, std::nullopt, {}, 0, 0, &ErrMsg)) {
+        fprintf(stderr, "Error: linking '%s' failed%s%s\n",
+                ExePath.str().c_str(), ErrMsg.empty() ? "" : ": ",
+                ErrMsg.c_str());
+        return false;
+    }
+    return true;
+}
+
+int CompileAheadOfTime(const char* Argv0) {
+    auto TM = CreateHostTargetMachine();
+    if (!TM)
+        return 1;
+    TargetMachine &HostTM = *TM;
+    SetTargetMachine(std::move(TM));
+
+    InitializeModuleAndManagers();
+    TheModule->setTargetTriple(HostTM.getTargetTriple().str());
+
+    // an object keeps its definitions visible so it can be linked into other
+    // programs; in an executable only main() needs to be
+    auto DefLinkage = Options.EmitExe ? GlobalValue::InternalLinkage
+                                      : GlobalValue::ExternalLinkage;
+    std::vector<Symbol> Thunks = GenerateProgram(DefLinkage);
+    if (Options.EmitExe || !Thunks.empty())
+        EmitMain(Thunks);
+    if (NumErrors)
+        return 1;
+
+    OptimizeModule();
+
+    // default output: script path without its extension, plus ".o" for -c
+    SmallString<256> OutPath(Options.OutputPath ? Options.OutputPath
+                                                : Options.ScriptPath);
+    if (!Options.OutputPath) {
+        sys::path::replace_extension(OutPath, Options.EmitExe ? "" : "o");
+        if (OutPath == Options.ScriptPath)
+            OutPath += ".out";
+    }
+
+    if (!Options.EmitExe)
+        return WriteObjectFile(HostTM, OutPath) ? 0 : 1;
+
+    SmallString<256> ObjPath;
+    if (sys::fs::createTemporaryFile("inhu", "o", ObjPath)) {
+        fprintf(stderr, "Error: cannot create a temporary object file\n");
+        return 1;
+    }
+    bool OK = WriteObjectFile(HostTM, ObjPath) &&
+              LinkExecutable(Argv0, ObjPath, OutPath);
+    sys::fs::remove(ObjPath);
+    return OK ? 0 : 1;
+}
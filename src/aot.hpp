@@ -0,0 +1,14 @@
+#ifndef my_aot_hpp
+#define my_aot_hpp
+
+/**
+ * @brief Compile the whole input ahead of time into a native object file
+ * (-c) or an executable linked against the runtime library (--emit-exe).
+ * The top-level expressions are run in order by a generated main().
+ *
+ * @param Argv0 argv[0], used to locate the runtime library
+ * @return int Exit status for the process
+ */
+int CompileAheadOfTime(const char* Argv0);
+
+#endif
@@ -1,29 +1,73 @@
 #include "ast.hpp"
+#include "driver.hpp"
+#include "multiversion.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "types.hpp"
+#include <cmath>
 #include <llvm/IR/Instructions.h>
+#include <mutex>
 
 using namespace llvm;
 
 // Variables for LLVM code generation
-std::unique_ptr<LLVMContext> TheContext;
-std::unique_ptr<Module> TheModule;
-std::unique_ptr<IRBuilder<>> Builder;
-std::map<std::string, Value*> NamedValues;
-
-std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-std::unique_ptr<llvm::StandardInstrumentations> TheSI;
-
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+thread_local std::unique_ptr<LLVMContext> TheContext;
+thread_local std::unique_ptr<Module> TheModule;
+thread_local std::unique_ptr<IRBuilder<>> Builder;
+thread_local ScopedSymbolMap<Value*> NamedValues;
+
+// values of pure nodes already emitted in the current function. Entries made
+// inside a branch or loop are dropped when leaving it, since they no longer
+// dominate the code that follows.
+static thread_local ScopedMap<ExprRef, Value*> ValueCache;
+
+// calls in tail position in the function being generated. A call of the
+// function to itself among them stores the new arguments into ArgSlots and
+// branches back to TailRecurseBB instead.
+static thread_local SmallVector<ExprRef, 4> TailCalls;
+static thread_local BasicBlock* TailRecurseBB;
+static thread_local SmallVector<AllocaInst*, 8> ArgSlots;
+
+// inferred types of the nodes of the function being generated
+static thread_local const std::vector<ValueType>* CurTypes;
+
+// clones declared for calls in the functions generated so far, whose bodies
+// are generated once the current definition is done
+static thread_local std::vector<
+        std::pair<std::shared_ptr<FunctionAST>, std::vector<ValueType>>>
+        PendingClones;
+
+thread_local std::unique_ptr<llvm::ModulePassManager> TheMPM;
+thread_local std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+thread_local std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+thread_local std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+thread_local std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+
+// prototypes of every function seen so far, shared by all threads
+static DenseMap<Symbol, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static std::mutex ProtosMutex;
+
+std::atomic<unsigned> NumErrors{0};
+thread_local std::string* ErrorBuffer;
 
 /*
  * Helper functions for error handling
  */
-std::unique_ptr<ExprAST> LogError(const char* msg) {
-    fprintf(stderr, "Error: %s\n", msg);
-    return nullptr;
+static void ReportError(const Twine &Msg) {
+    ++NumErrors;
+    if (ErrorBuffer)
+        *ErrorBuffer += Msg.str();
+    else
+        fputs(Msg.str().c_str(), stderr);
+}
+
+ExprRef LogError(const char* msg) {
+    const SourceLocation &Loc = TheLexer->getTokLoc();
+    ReportError("Error (line " + Twine(Loc.Line) + ", col " + Twine(Loc.Col) +
+                "): " + msg + "\n");
+    return NoExpr;
 }
 
 std::unique_ptr<PrototypeAST> LogErrorP(const char* msg) {
@@ -32,16 +76,22 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char* msg) {
 }
 
 Value* LogErrorV(const char* msg) {
-    LogError(msg);
+    ReportError(Twine("Error: ") + msg + "\n");
     return nullptr;
 }
 
-static Function* getFunction(std::string Name) {
+void registerPrototype(std::unique_ptr<PrototypeAST> Proto) {
+    std::lock_guard<std::mutex> Guard(ProtosMutex);
+    FunctionProtos[Proto->getName()] = std::move(Proto);
+}
+
+static Function* getFunction(Symbol Name) {
     // see if function was added to current module
-    if (auto *F = TheModule->getFunction(Name))
+    if (auto *F = TheModule->getFunction(Symbols.name(Name)))
         return F;
 
     // check if we can codegen decl from existing prototype
+    std::lock_guard<std::mutex> Guard(ProtosMutex);
     auto FI = FunctionProtos.find(Name);
     if (FI != FunctionProtos.end())
         return FI->second->codegen();
@@ -50,70 +100,471 @@ static Function* getFunction(std::string Name) {
 }
 
 /**
- * @brief NumberExprAST constructor definition
+ * @brief ExprPool constructor. Slot 0 is taken by a placeholder node so that
+ * NoExpr never refers to a real expression.
+ */
+ExprPool::ExprPool() {
+    // enough for a typical definition without regrowing
+    Nodes.reserve(64);
+    Operands.reserve(128);
+    Constants.reserve(16);
+    Nodes.push_back(ExprNode{ExprKind::Number, 0, 0, 0, 0});
+    PureNodes.push_back(false);
+}
+
+void ExprPool::finish() {
+    ConsTable = {};
+
+    for (ExprRef E = 1; E < Nodes.size(); ++E)
+        if ((kind(E) == ExprKind::Var || kind(E) == ExprKind::Assign) &&
+            !isMutable(symbol(E)))
+            MutableVars.push_back(symbol(E));
+    if (MutableVars.empty())
+        return;
+
+    // operands come before the nodes using them
+    for (ExprRef E = 1; E < Nodes.size(); ++E) {
+        if (!isPure(E))
+            continue;
+        bool ReadsMutable = kind(E) == ExprKind::Variable
+                ? isMutable(symbol(E))
+                : any_of(operands(E), [&](ExprRef Op) { return !isPure(Op); });
+        if (ReadsMutable)
+            PureNodes.reset(E);
+    }
+}
+
+ExprRef ExprPool::add(ExprKind Kind, char Oper, uint32_t Data,
+                      ArrayRef<ExprRef> Ops) {
+    assert(Ops.size() <= MaxOperands && "too many operands for a node");
+    ExprRef E = Nodes.size();
+    Nodes.push_back(ExprNode{Kind, Oper, (uint16_t)Ops.size(), Data,
+                             (uint32_t)Operands.size()});
+    Operands.insert(Operands.end(), Ops.begin(), Ops.end());
+    PureNodes.push_back(false);
+    return E;
+}
+
+/**
+ * @brief Add a pure node, or return the existing node with the same key
+ */
+ExprRef ExprPool::addPure(ConsKey Key, ExprKind Kind, char Oper,
+                          uint32_t Data, ArrayRef<ExprRef> Ops) {
+    auto [It, Inserted] = ConsTable.try_emplace(Key, NoExpr);
+    if (Inserted) {
+        It->second = add(Kind, Oper, Data, Ops);
+        PureNodes.set(It->second);
+    }
+    return It->second;
+}
+
+ExprRef ExprPool::addNumber(double Val) {
+    ConsKey Key((uint64_t)ExprKind::Number, llvm::bit_cast<uint64_t>(Val));
+    auto It = ConsTable.find(Key);
+    if (It != ConsTable.end())
+        return It->second;
+    Constants.push_back(Val);
+    return addPure(Key, ExprKind::Number, 0, Constants.size() - 1, {});
+}
+
+ExprRef ExprPool::addVariable(Symbol Name) {
+    return addPure(ConsKey((uint64_t)ExprKind::Variable, Name),
+                   ExprKind::Variable, 0, Name, {});
+}
+
+ExprRef ExprPool::addUnary(char OpCode, ExprRef Operand) {
+    return add(ExprKind::Unary, OpCode, 0, {Operand});
+}
+
+ExprRef ExprPool::addBinary(char Oper, ExprRef LHS, ExprRef RHS) {
+    if (isBuiltinBinOp(Oper) && isPure(LHS) && isPure(RHS)) {
+        ConsKey Key((uint64_t)ExprKind::Binary | (uint64_t)(uint8_t)Oper << 8,
+                    (uint64_t)LHS << 32 | RHS);
+        return addPure(Key, ExprKind::Binary, Oper, 0, {LHS, RHS});
+    }
+    return add(ExprKind::Binary, Oper, 0, {LHS, RHS});
+}
+
+ExprRef ExprPool::addCall(Symbol Callee, ArrayRef<ExprRef> Args) {
+    return add(ExprKind::Call, 0, Callee, Args);
+}
+
+ExprRef ExprPool::addIf(ExprRef Cond, ExprRef Then, ExprRef Else) {
+    return add(ExprKind::If, 0, 0, {Cond, Then, Else});
+}
+
+ExprRef ExprPool::addFor(Symbol VarName, ExprRef Start, ExprRef End,
+                         ExprRef Step, ExprRef Body) {
+    return add(ExprKind::For, 0, VarName, {Start, End, Step, Body});
+}
+
+ExprRef ExprPool::addParallelFor(Symbol VarName, ExprRef Start, ExprRef End,
+                                 ExprRef Step, ExprRef Body) {
+    return add(ExprKind::ParallelFor, 0, VarName, {Start, End, Step, Body});
+}
+
+ExprRef ExprPool::addIndex(ExprRef Array, ExprRef Index) {
+    return add(ExprKind::Index, 0, 0, {Array, Index});
+}
+
+ExprRef ExprPool::addStore(ExprRef Array, ExprRef Index, ExprRef Value) {
+    return add(ExprKind::Store, 0, 0, {Array, Index, Value});
+}
+
+ExprRef ExprPool::addVar(Symbol VarName, ExprRef Init, ExprRef Body) {
+    return add(ExprKind::Var, 0, VarName, {Init, Body});
+}
+
+ExprRef ExprPool::addAssign(Symbol VarName, ExprRef Value) {
+    return add(ExprKind::Assign, 0, VarName, {Value});
+}
+
+bool isBuiltinBinOp(char Oper) {
+    switch (Oper) {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+        case '<':
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief The i64 a double is known to equal exactly, if any: an integer
+ * constant, a value converted from an i64 (a loop counter or an array
+ * length), or the sum or difference of two such values. The sum is the
+ * exact one, which the double only equals below 2^53, so this is only used
+ * on values type inference has bounded.
  *
- * @param Val 
+ * @return Value* The integer, emitted at the current insertion point if it
+ * has to be computed, or nullptr
  */
-NumberExprAST::NumberExprAST(double Val)
-    : Val(Val) {}
+static Value* getExactInt(Value* V) {
+    if (auto* Conv = dyn_cast<SIToFPInst>(V)) {
+        if (Conv->getSrcTy()->isIntegerTy(64))
+            return Conv->getOperand(0);
+        return nullptr;
+    }
+    if (auto* C = dyn_cast<ConstantFP>(V)) {
+        const APFloat &F = C->getValueAPF();
+        if (!F.isInteger() || std::fabs(F.convertToDouble()) >= 0x1p53)
+            return nullptr;
+        return Builder->getInt64((int64_t)F.convertToDouble());
+    }
+    auto* BO = dyn_cast<BinaryOperator>(V);
+    if (!BO || (BO->getOpcode() != Instruction::FAdd &&
+                BO->getOpcode() != Instruction::FSub))
+        return nullptr;
+    Value* L = getExactInt(BO->getOperand(0));
+    Value* R = L ? getExactInt(BO->getOperand(1)) : nullptr;
+    if (!R)
+        return nullptr;
+    if (BO->getOpcode() == Instruction::FAdd)
+        return Builder->CreateAdd(L, R, "addtmp");
+    return Builder->CreateSub(L, R, "subtmp");
+}
 
 /**
- * @brief NumberExprAST Codegen
+ * @brief Whether type inference proved an expression of the function being
+ * generated to be a whole number
+ */
+static bool isInt(ExprRef E) {
+    return CurTypes && (*CurTypes)[E] == ValueType::Int;
+}
+
+/**
+ * @brief The i64 equal to V, which must be a whole number
+ */
+static Value* asInt(Value* V) {
+    if (Value* I = getExactInt(V))
+        return I;
+    return Builder->CreateFPToSI(V, Builder->getInt64Ty(), "int");
+}
+
+/**
+ * @brief The i64 equal to V, the value of E, if it is known to be one. For
+ * a WideInt it is the exact sum, which V is that sum rounded to a double.
+ */
+static Value* getIntValue(ExprRef E, Value* V) {
+    if (isInt(E))
+        return asInt(V);
+    if (CurTypes && (*CurTypes)[E] == ValueType::WideInt)
+        return getExactInt(V);
+    return nullptr;
+}
+
+/**
+ * @brief Layout of an array: its length, followed by the elements
+ */
+static StructType* getArrayType() {
+    return StructType::get(Builder->getInt64Ty(),
+                           ArrayType::get(Builder->getDoubleTy(), 0));
+}
+
+/**
+ * @brief Address of an array from its handle. Arrays are passed around as
+ * doubles carrying the bits of their address.
+ */
+static Value* getArrayAddress(Value* Handle) {
+    return Builder->CreateIntToPtr(
+            Builder->CreateBitCast(Handle, Builder->getInt64Ty()),
+            Builder->getPtrTy(), "array");
+}
+
+/**
+ * @brief Load the length of an array. It never changes once the array is
+ * allocated, so loops can keep it in a register.
+ */
+static Value* loadArrayLength(Value* Array) {
+    LoadInst* Len = Builder->CreateAlignedLoad(Builder->getInt64Ty(), Array,
+                                               Align(8), "len");
+    Len->setMetadata(LLVMContext::MD_invariant_load,
+                     MDNode::get(*TheContext, {}));
+    return Len;
+}
+
+/**
+ * @brief Branch weights for a branch that almost always goes to its first
+ * successor, the same as llvm.expect gives
+ */
+static MDNode* likelyBranchWeights() {
+    return MDBuilder(*TheContext).createBranchWeights(2000, 1);
+}
+
+/**
+ * @brief Address of an array element, after checking the index against the
+ * length. Indices are truncated toward zero. A WideInt index is only in
+ * bounds where it is below 2^53 and so equal to its double.
+ */
+static Value* codegenElementAddress(Value* Handle, ExprRef IndexE,
+                                    Value* IndexV) {
+    Value* Array = getArrayAddress(Handle);
+    Value* Len = loadArrayLength(Array);
+
+    // saturating, so that no double gives a poison index
+    Value* Idx = getIntValue(IndexE, IndexV);
+    bool MayBeNaN = !Idx;
+    if (!Idx)
+        Idx = Builder->CreateIntrinsic(Intrinsic::fptosi_sat,
+                                       {Builder->getInt64Ty(),
+                                        Builder->getDoubleTy()},
+                                       {IndexV}, nullptr, "idx");
+
+    // negative indices compare as huge unsigned ones, so a single check
+    // covers both ends. A NaN index saturates to 0 and is checked apart.
+    Value* InBounds = Builder->CreateICmpULT(Idx, Len, "inbounds");
+    if (MayBeNaN)
+        InBounds = Builder->CreateAnd(
+                Builder->CreateFCmpORD(IndexV, IndexV, "notnan"), InBounds);
+
+    Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock* FailBB = BasicBlock::Create(*TheContext, "outofbounds",
+                                            TheFunction);
+    BasicBlock* OkBB = BasicBlock::Create(*TheContext, "inbounds",
+                                          TheFunction);
+    Builder->CreateCondBr(InBounds, OkBB, FailBB,
+                          likelyBranchWeights());
+
+    Builder->SetInsertPoint(FailBB);
+    FunctionCallee BoundsError = TheModule->getOrInsertFunction(
+            "__inhu_bounds_error", Builder->getVoidTy(),
+            Builder->getDoubleTy(), Builder->getInt64Ty());
+    if (auto* F = dyn_cast<Function>(BoundsError.getCallee())) {
+        F->setDoesNotReturn();
+        F->addFnAttr(Attribute::Cold);
+    }
+    Builder->CreateCall(BoundsError, {IndexV, Len});
+    Builder->CreateUnreachable();
+
+    Builder->SetInsertPoint(OkBB);
+    return Builder->CreateInBoundsGEP(getArrayType(), Array,
+                                      {Builder->getInt32(0),
+                                       Builder->getInt32(1), Idx},
+                                      "eltptr");
+}
+
+/**
+ * @brief Codegen for reading an array element
  *
- * @return ConstantFP
+ * @return Value*
  */
-Value* NumberExprAST::codegen() {
-    /* APFloat(Val) --> can hold floating point constant
-     * arbitrary precision
-     */
-    return ConstantFP::get(*TheContext, APFloat(Val));
+static Value* codegenIndex(const ExprPool &Pool, ExprRef E) {
+    Value* Handle = codegenExpr(Pool, Pool.operand(E, 0));
+    Value* IndexV = codegenExpr(Pool, Pool.operand(E, 1));
+    if (!Handle || !IndexV)
+        return nullptr;
+
+    Value* Addr = codegenElementAddress(Handle, Pool.operand(E, 1), IndexV);
+    return Builder->CreateAlignedLoad(Builder->getDoubleTy(), Addr, Align(8),
+                                      "elt");
 }
 
 /**
- * @brief VariableExprAST constructor definition
+ * @brief Codegen for assigning to an array element. The value of the
+ * assignment is the value assigned.
  *
- * @param Name
+ * @return Value*
  */
-VariableExprAST::VariableExprAST(const std::string &Name)
-    : Name(Name) {}
+static Value* codegenStore(const ExprPool &Pool, ExprRef E) {
+    Value* Handle = codegenExpr(Pool, Pool.operand(E, 0));
+    Value* IndexV = codegenExpr(Pool, Pool.operand(E, 1));
+    Value* Val = codegenExpr(Pool, Pool.operand(E, 2));
+    if (!Handle || !IndexV || !Val)
+        return nullptr;
+
+    Value* Addr = codegenElementAddress(Handle, Pool.operand(E, 1), IndexV);
+    Builder->CreateAlignedStore(Val, Addr, Align(8));
+    return Val;
+}
 
 /**
- * @brief VariableExprAST codegen
+ * @brief Codegen for the builtin array functions: array(n) allocates n
+ * elements set to 0, len(a) is the number of elements and free(a) releases
+ * the array, evaluating to 0
  *
  * @return Value*
  */
-Value* VariableExprAST::codegen() {
-    Value* V = NamedValues[Name];
+static Value* codegenArrayBuiltin(const ExprPool &Pool, ExprRef E) {
+    ArrayRef<ExprRef> Args = Pool.operands(E);
+    if (Args.size() != 1)
+        return LogErrorV("Incorrect number of arguments passed");
+    Value* Arg = codegenExpr(Pool, Args[0]);
+    if (!Arg)
+        return nullptr;
+
+    if (Pool.symbol(E) == sym_len)
+        return Builder->CreateSIToFP(loadArrayLength(getArrayAddress(Arg)),
+                                     Builder->getDoubleTy(), "lentmp");
+
+    if (Pool.symbol(E) == sym_free) {
+        FunctionCallee FreeArray = TheModule->getOrInsertFunction(
+                "__inhu_array_free", Builder->getVoidTy(), Builder->getPtrTy());
+        Builder->CreateCall(FreeArray, getArrayAddress(Arg));
+        return ConstantFP::get(*TheContext, APFloat(0.0));
+    }
+
+    FunctionCallee NewArray = TheModule->getOrInsertFunction(
+            "__inhu_array_new", Builder->getPtrTy(), Builder->getDoubleTy());
+    Value* Array = Builder->CreateCall(NewArray, Arg, "array");
+    return Builder->CreateBitCast(
+            Builder->CreatePtrToInt(Array, Builder->getInt64Ty()),
+            Builder->getDoubleTy(), "arraytmp");
+}
+
+/**
+ * @brief Create an alloca in the entry block of the current function, so it
+ * is allocated once however often the code using it runs
+ */
+static AllocaInst* createEntryBlockAlloca(Type* Ty, const Twine &Name) {
+    Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                     TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, nullptr, Name);
+}
+
+/**
+ * @brief Current value of a variable binding. Variables that can be assigned
+ * are bound to their stack slot.
+ */
+static Value* readVariable(Value* V, Symbol Name) {
+    if (auto* Slot = dyn_cast<AllocaInst>(V))
+        V = Builder->CreateLoad(Slot->getAllocatedType(), Slot,
+                                Symbols.name(Name));
+
+    // integer arguments of specialized clones
+    if (V->getType()->isIntegerTy())
+        V = Builder->CreateSIToFP(V, Builder->getDoubleTy(),
+                                  Symbols.name(Name));
+    return V;
+}
+
+/**
+ * @brief Codegen for a variable reference
+ *
+ * @return Value*
+ */
+static Value* codegenVariable(const ExprPool &Pool, ExprRef E) {
+    Value* V = NamedValues.lookup(Pool.symbol(E));
     if (!V)
         return LogErrorV("Unknown variable name");
-    return V;
+    return readVariable(V, Pool.symbol(E));
 }
 
 /**
- * @brief BinaryExprAST constructor definition
+ * @brief Codegen for 'var' expressions. The variable gets a stack slot in
+ * the entry block, which SROA turns back into SSA values, so accumulators
+ * updated in a loop end up in registers.
  *
- * @param Oper 
- * @param LHS 
- * @param RHS 
+ * @return Value* Value of the body
  */
-BinaryExprAST::BinaryExprAST(char Oper,
-                             std::unique_ptr<ExprAST> LHS,
-                             std::unique_ptr<ExprAST> RHS) 
-    : Oper(Oper) , LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+static Value* codegenVar(const ExprPool &Pool, ExprRef E) {
+    Symbol VarName = Pool.symbol(E);
+
+    // the initializer still sees an outer variable of the same name
+    Value* InitVal = codegenExpr(Pool, Pool.operand(E, 0));
+    if (!InitVal)
+        return nullptr;
+    AllocaInst* Slot = createEntryBlockAlloca(Builder->getDoubleTy(),
+                                              Symbols.name(VarName));
+    Builder->CreateStore(InitVal, Slot);
+
+    NamedValues.pushScope();
+    NamedValues.insert(VarName, Slot);
+    Value* BodyVal = codegenExpr(Pool, Pool.operand(E, 1));
+    NamedValues.popScope();
+    return BodyVal;
+}
 
 /**
- * @brief BinaryExprAST codegen definition
+ * @brief Codegen for assignments to a variable
+ *
+ * @return Value* The assigned value
+ */
+static Value* codegenAssign(const ExprPool &Pool, ExprRef E) {
+    Value* Val = codegenExpr(Pool, Pool.operand(E, 0));
+    if (!Val)
+        return nullptr;
+
+    Value* V = NamedValues.lookup(Pool.symbol(E));
+    if (!V)
+        return LogErrorV("Unknown variable name");
+    auto* Slot = dyn_cast<AllocaInst>(V);
+    if (!Slot)
+        return LogErrorV("Cannot assign to a loop variable, or to an outer "
+                         "variable inside 'parallel for'");
+    Builder->CreateStore(Val, Slot);
+    return Val;
+}
+
+/**
+ * @brief Codegen for binary operations
  *
  * @return Value*
  */
-Value* BinaryExprAST::codegen() {
+static Value* codegenBinary(const ExprPool &Pool, ExprRef E) {
     // recursively emit code for LHS and then RHS
-    Value* L = LHS->codegen();
-    Value* R = RHS->codegen();
+    Value* L = codegenExpr(Pool, Pool.operand(E, 0));
+    Value* R = codegenExpr(Pool, Pool.operand(E, 1));
 
     if (!L || !R)
         return nullptr;
     
+    // sums and differences of whole numbers are computed in integers. The
+    // result is converted back for users that need a double, which later
+    // integer operations see through.
+    char Oper = Pool.oper(E);
+    if ((Oper == '+' || Oper == '-') && isInt(E)) {
+        Value* LI = asInt(L);
+        Value* RI = asInt(R);
+        Value* Result = Oper == '+' ? Builder->CreateAdd(LI, RI, "addtmp")
+                                    : Builder->CreateSub(LI, RI, "subtmp");
+        return Builder->CreateSIToFP(Result, Builder->getDoubleTy(),
+                                     Result->getName());
+    }
+
     switch (Oper) {
         case '+':
             return Builder->CreateFAdd(L, R, "addtmp");
@@ -124,6 +575,19 @@ Value* BinaryExprAST::codegen() {
         case '/':
             return Builder->CreateFDiv(L, R, "divtmp");
         case '<':
+            // integers compare as such, so that loop bounds over counters
+            // and array lengths are visible to the loop optimizations. A
+            // WideInt rounds to a double on the same side of an Int as its
+            // exact value, but two of them may round to the same double.
+            if (isInt(Pool.operand(E, 0)) || isInt(Pool.operand(E, 1))) {
+                if (Value* LI = getIntValue(Pool.operand(E, 0), L)) {
+                    if (Value* RI = getIntValue(Pool.operand(E, 1), R)) {
+                        L = Builder->CreateICmpSLT(LI, RI, "cmptmp");
+                        return Builder->CreateUIToFP(L,
+                                Type::getDoubleTy(*TheContext), "booltmp");
+                    }
+                }
+            }
             L = Builder->CreateFCmpULT(L, R, "cmptmp");
             return Builder->CreateUIToFP(L,
                     Type::getDoubleTy(*TheContext), "booltmp");
@@ -131,7 +595,7 @@ Value* BinaryExprAST::codegen() {
             break;
     }
     // if not a builtin oper, then look for a user-defined one
-    Function *F = getFunction(std::string("binary") + Oper);
+    Function *F = getFunction(Symbols.opSymbol(true, Oper));
     assert(F && "Binary Operator not found!");
 
     Value* Ops[2] = {L, R};
@@ -139,25 +603,16 @@ Value* BinaryExprAST::codegen() {
 }
 
 /**
- * @brief UnaryExprAST constructor definition
- *
- * @param OpCode 
- * @param Operand 
- */
-UnaryExprAST::UnaryExprAST(char OpCode, std::unique_ptr<ExprAST> Operand)
-    : OpCode(OpCode), Operand(std::move(Operand)) {}
-
-/**
- * @brief Codegen implementation for UnarExprAST
+ * @brief Codegen for unary operations
  *
- * @return 
+ * @return Value*
  */
-Value* UnaryExprAST::codegen() {
-    Value* OperandV = Operand->codegen();
+static Value* codegenUnary(const ExprPool &Pool, ExprRef E) {
+    Value* OperandV = codegenExpr(Pool, Pool.operand(E, 0));
     if (!OperandV)
         return nullptr;
 
-    Function *F = getFunction(std::string("unary") + OpCode);
+    Function *F = getFunction(Symbols.opSymbol(false, Pool.oper(E)));
     if (!F)
         return LogErrorV("Unknown unary operator");
 
@@ -165,58 +620,226 @@ Value* UnaryExprAST::codegen() {
 }
 
 /**
- * @brief CallExprAST constructor definition
+ * @brief Clone of the callee of a call specialized to the types of its
+ * arguments: whole-number arguments are passed as i64 and stay integers in
+ * the body. The clone is private to the current module and its body is
+ * generated once the current definition is done.
  *
- * @param Callee 
- * @param Args 
+ * @return Function* The clone, or nullptr to call the generic version,
+ * e.g. if no argument is known to be a whole number or the callee is an
+ * extern
  */
-CallExprAST::CallExprAST(const std::string &Callee,
-                         std::vector<std::unique_ptr<ExprAST>> Args)
-    : Callee(Callee), Args(std::move(Args)) {}
+static Function* getSpecializedCallee(const ExprPool &Pool, ExprRef E) {
+    if (!CurTypes)
+        return nullptr;
+    SmallVector<ValueType, 8> ArgTypes;
+    for (ExprRef Arg : Pool.operands(E))
+        ArgTypes.push_back((*CurTypes)[Arg]);
+    if (all_of(ArgTypes, [](ValueType T) { return T == ValueType::Double; }))
+        return nullptr;
+
+    std::shared_ptr<FunctionAST> Callee =
+            getSpecializableDefinition(Pool.symbol(E));
+    if (!Callee || Callee->getProto().getArgs().size() != ArgTypes.size())
+        return nullptr;
+    std::vector<ValueType> Types = getSpecialization(*Callee, ArgTypes);
+    if (Types.empty())
+        return nullptr;
+
+    std::string Name = getSpecializedName(Pool.symbol(E), Types);
+    if (Function* F = TheModule->getFunction(Name))
+        return F;
+
+    SmallVector<Type*, 8> Params;
+    for (ValueType Type : Types)
+        Params.push_back(Type == ValueType::Int ? Builder->getInt64Ty()
+                                                : Builder->getDoubleTy());
+    Function* F = Function::Create(
+            FunctionType::get(Builder->getDoubleTy(), Params, false),
+            Function::InternalLinkage, Name, TheModule.get());
+    unsigned Idx = 0;
+    for (auto &Arg : F->args())
+        Arg.setName(Symbols.name(Callee->getProto().getArgs()[Idx++]));
+    PendingClones.emplace_back(std::move(Callee), std::move(Types));
+    return F;
+}
+
+/**
+ * @brief LLVM intrinsic computing the same as a libm function declared with
+ * 'extern', or not_intrinsic. A function of the same name defined in the
+ * program keeps its own meaning.
+ */
+static Intrinsic::ID getMathIntrinsic(Symbol Name, const Function &Callee) {
+    auto [ID, NumArgs] =
+            StringSwitch<std::pair<Intrinsic::ID, unsigned>>(Symbols.name(Name))
+                    .Case("sqrt", {Intrinsic::sqrt, 1})
+                    .Case("sin", {Intrinsic::sin, 1})
+                    .Case("cos", {Intrinsic::cos, 1})
+                    .Case("exp", {Intrinsic::exp, 1})
+                    .Case("exp2", {Intrinsic::exp2, 1})
+                    .Case("log", {Intrinsic::log, 1})
+                    .Case("log2", {Intrinsic::log2, 1})
+                    .Case("log10", {Intrinsic::log10, 1})
+                    .Case("pow", {Intrinsic::pow, 2})
+                    .Case("fabs", {Intrinsic::fabs, 1})
+                    .Case("floor", {Intrinsic::floor, 1})
+                    .Case("ceil", {Intrinsic::ceil, 1})
+                    .Case("trunc", {Intrinsic::trunc, 1})
+                    .Case("round", {Intrinsic::round, 1})
+                    .Case("fmin", {Intrinsic::minnum, 2})
+                    .Case("fmax", {Intrinsic::maxnum, 2})
+                    .Case("copysign", {Intrinsic::copysign, 2})
+                    .Case("fma", {Intrinsic::fma, 3})
+                    .Default({Intrinsic::not_intrinsic, 0});
+    if (ID == Intrinsic::not_intrinsic || Callee.arg_size() != NumArgs ||
+        !Callee.isDeclaration() || getSpecializableDefinition(Name))
+        return Intrinsic::not_intrinsic;
+    return ID;
+}
 
 /**
- * @brief CallExprAST codegen
+ * @brief Emit a call of Callee. A call in tail position is marked as such,
+ * and becomes a jump back to the start if it calls the current function.
+ */
+static Value* emitCall(Function* Callee, ArrayRef<Value*> ArgsV, bool Tail) {
+    if (!Tail)
+        return Builder->CreateCall(Callee, ArgsV, "calltmp");
+
+    Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    if (Callee != TheFunction) {
+        // nothing on our stack is passed along, so the backend may reuse
+        // the frame
+        CallInst* Call = Builder->CreateCall(Callee, ArgsV, "calltmp");
+        Call->setTailCall();
+        return Call;
+    }
+
+    // self-recursion in tail position starts the body over with the new
+    // arguments, so it runs in constant stack space at any -O level
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+        Builder->CreateStore(ArgsV[i], ArgSlots[i]);
+    Builder->CreateBr(TailRecurseBB);
+
+    // nothing after the call runs, but the enclosing 'if' still takes a
+    // value from here
+    Builder->SetInsertPoint(
+            BasicBlock::Create(*TheContext, "aftertail", TheFunction));
+    return PoisonValue::get(Builder->getDoubleTy());
+}
+
+/**
+ * @brief Codegen for function calls
  *
  * @return Value*
  */
-Value* CallExprAST::codegen() {
+static Value* codegenCall(const ExprPool &Pool, ExprRef E) {
     // look up name in global module table
-    Function* CalleeF = getFunction(Callee);
+    Function* CalleeF = getFunction(Pool.symbol(E));
+    if (!CalleeF && (Pool.symbol(E) == sym_array ||
+                     Pool.symbol(E) == sym_len || Pool.symbol(E) == sym_free))
+        return codegenArrayBuiltin(Pool, E);
     if (!CalleeF)
         return LogErrorV("Unknown function referred");
 
+    ArrayRef<ExprRef> Args = Pool.operands(E);
     if (CalleeF->arg_size() != Args.size())
         return LogErrorV("Incorrect number of arguments passed");
 
-    std::vector<Value*> ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-        ArgsV.push_back(Args[i]->codegen());
+    SmallVector<Value*, 8> ArgsV;
+    for (ExprRef Arg : Args) {
+        ArgsV.push_back(codegenExpr(Pool, Arg));
         if (!ArgsV.back())
             return nullptr;
     }
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+
+    // the optimizer knows what the intrinsics compute: it folds them on
+    // constants, hoists them out of loops and vectorizes them. They still
+    // become libm calls where the target has no instruction for them.
+    if (Intrinsic::ID ID = getMathIntrinsic(Pool.symbol(E), *CalleeF))
+        return Builder->CreateIntrinsic(ID, {Builder->getDoubleTy()}, ArgsV,
+                                        nullptr, "calltmp");
+
+    bool Tail = is_contained(TailCalls, E);
+    Function* Clone = getSpecializedCallee(Pool, E);
+    if (!Clone)
+        return emitCall(CalleeF, ArgsV, Tail);
+
+    // the clone takes integers below 2^53. A WideInt argument is its exact
+    // sum, which is below 2^53 exactly when its double is; if it is not,
+    // the call goes to the generic version with the double.
+    SmallVector<Value*, 8> CloneArgsV(ArgsV.begin(), ArgsV.end());
+    Value* Fits = nullptr;
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+        if (!Clone->getArg(i)->getType()->isIntegerTy())
+            continue;
+        CloneArgsV[i] = asInt(ArgsV[i]);
+        if ((*CurTypes)[Args[i]] != ValueType::WideInt)
+            continue;
+        Value* Below = Builder->CreateICmpULE(
+                Builder->CreateAdd(CloneArgsV[i],
+                                   Builder->getInt64((1LL << 53) - 1)),
+                Builder->getInt64((1LL << 54) - 2), "fits");
+        Fits = Fits ? Builder->CreateAnd(Fits, Below) : Below;
+    }
+    if (!Fits)
+        return emitCall(Clone, CloneArgsV, Tail);
+
+    Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock* CloneBB = BasicBlock::Create(*TheContext, "toclone",
+                                             TheFunction);
+    BasicBlock* GenericBB = BasicBlock::Create(*TheContext, "togeneric",
+                                               TheFunction);
+    BasicBlock* MergeBB = BasicBlock::Create(*TheContext, "aftercall",
+                                             TheFunction);
+    Builder->CreateCondBr(Fits, CloneBB, GenericBB,
+                          likelyBranchWeights());
+
+    Builder->SetInsertPoint(CloneBB);
+    Value* CloneV = emitCall(Clone, CloneArgsV, Tail);
+    CloneBB = Builder->GetInsertBlock();
+    Builder->CreateBr(MergeBB);
+
+    Builder->SetInsertPoint(GenericBB);
+    Value* GenericV = emitCall(CalleeF, ArgsV, Tail);
+    GenericBB = Builder->GetInsertBlock();
+    Builder->CreateBr(MergeBB);
+
+    Builder->SetInsertPoint(MergeBB);
+    PHINode* PN = Builder->CreatePHI(Builder->getDoubleTy(), 2, "calltmp");
+    PN->addIncoming(CloneV, CloneBB);
+    PN->addIncoming(GenericV, GenericBB);
+    return PN;
 }
 
 /**
- * @brief 'If' expression constructor
- *
- * @param ExprAST 
- * @param Cond 
- * @param Then 
- * @param Else 
+ * @brief Collect the calls whose value is the value of the whole expression,
+ * through the branches of 'if' and the bodies of 'var'
  */
-IfExprAST::IfExprAST(std::unique_ptr<ExprAST> Cond,
-              std::unique_ptr<ExprAST> Then,
-              std::unique_ptr<ExprAST> Else)
-    : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+static void collectTailCalls(const ExprPool &Pool, ExprRef E,
+                             SmallVectorImpl<ExprRef> &Calls) {
+    switch (Pool.kind(E)) {
+        case ExprKind::Call:
+            Calls.push_back(E);
+            break;
+        case ExprKind::If:
+            collectTailCalls(Pool, Pool.operand(E, 1), Calls);
+            collectTailCalls(Pool, Pool.operand(E, 2), Calls);
+            break;
+        case ExprKind::Var:
+            collectTailCalls(Pool, Pool.operand(E, 1), Calls);
+            break;
+        default:
+            break;
+    }
+}
 
 /**
- * @brief 'If' expression codegen() implementation
+ * @brief Codegen for 'if' expressions
  *
- * @return 
+ * @return Value*
  */
-Value* IfExprAST::codegen() {
-    Value* CondV = Cond->codegen();
+static Value* codegenIf(const ExprPool &Pool, ExprRef E) {
+    Value* CondV = codegenExpr(Pool, Pool.operand(E, 0));
     if (!CondV)
         return nullptr;
 
@@ -229,10 +852,13 @@ Value* IfExprAST::codegen() {
     BasicBlock* ElseBB = BasicBlock::Create(*TheContext, "else");
     BasicBlock* MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    profileBranch(Builder->CreateCondBr(CondV, ThenBB, ElseBB), E);
 
     Builder->SetInsertPoint(ThenBB);
-    Value* ThenV = Then->codegen();
+    profileEdge(E, 0);
+    ValueCache.pushScope();
+    Value* ThenV = codegenExpr(Pool, Pool.operand(E, 1));
+    ValueCache.popScope();
     if (!ThenV)
         return nullptr;
 
@@ -241,8 +867,11 @@ Value* IfExprAST::codegen() {
 
     TheFunction->insert(TheFunction->end(), ElseBB);
     Builder->SetInsertPoint(ElseBB);
+    profileEdge(E, 1);
 
-    Value* ElseV = Else->codegen();
+    ValueCache.pushScope();
+    Value* ElseV = codegenExpr(Pool, Pool.operand(E, 2));
+    ValueCache.popScope();
     if (!ElseV)
         return nullptr;
 
@@ -258,24 +887,15 @@ Value* IfExprAST::codegen() {
 }
 
 /**
- * @brief 'for' expression constructor
+ * @brief Codegen for 'for' loops
  *
- * @param VarName 
- * @param Start 
- * @param End 
- * @param Step 
- * @param Body 
+ * @return Value*
  */
-ForExprAST::ForExprAST(const std::string &VarName,
-                       std::unique_ptr<ExprAST> Start,
-                       std::unique_ptr<ExprAST> End,
-                       std::unique_ptr<ExprAST> Step,
-                       std::unique_ptr<ExprAST> Body)
-    : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-      Step(std::move(Step)), Body(std::move(Body)) {}
+static Value* codegenFor(const ExprPool &Pool, ExprRef E) {
+    Symbol VarName = Pool.symbol(E);
+    ExprRef Step = Pool.operand(E, 2);
 
-Value* ForExprAST::codegen() {
-    Value* StartVal = Start->codegen();
+    Value* StartVal = codegenExpr(Pool, Pool.operand(E, 0));
     if (!StartVal)
         return nullptr;
 
@@ -288,33 +908,67 @@ Value* ForExprAST::codegen() {
     Builder->CreateBr(LoopBB);
     Builder->SetInsertPoint(LoopBB);
 
+    // counting from an integer in constant integer steps, the variable only
+    // takes integer values. It is then carried in an integer induction
+    // variable, which the loop optimizations and vectorizers understand.
+    Value* StartInt = getIntValue(Pool.operand(E, 0), StartVal);
+    Value* StepInt = nullptr;
+    if (!Step)
+        StepInt = Builder->getInt64(1);
+    else if (Pool.kind(Step) == ExprKind::Number)
+        StepInt = getExactInt(ConstantFP::get(*TheContext,
+                                              APFloat(Pool.number(Step))));
+    bool IntegerIV = StartInt && StepInt;
+
     // PHI node
-    PHINode* Variable = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, VarName);
-    Variable->addIncoming(StartVal, PreheaderBB);
+    PHINode* IV;
+    Value* Variable;
+    if (IntegerIV) {
+        IV = Builder->CreatePHI(Builder->getInt64Ty(), 2,
+                                Symbols.name(VarName) + ".iv");
+        IV->addIncoming(StartInt, PreheaderBB);
+        Variable = Builder->CreateSIToFP(IV, Type::getDoubleTy(*TheContext),
+                                         Symbols.name(VarName));
+    } else {
+        IV = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2,
+                                Symbols.name(VarName));
+        IV->addIncoming(StartVal, PreheaderBB);
+        Variable = IV;
+    }
+    profileEdge(E, 0);
 
-    // variable == phi node in the loop. If loop variable is already an existing
-    // variable, save it to 'OldVal'
-    Value* OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Variable;
+    // variable == phi node in the loop. It shadows any existing variable of
+    // the same name until the loop scope is popped
+    NamedValues.pushScope();
+    NamedValues.insert(VarName, Variable);
+
+    // cached values may depend on the shadowed variable, so the loop starts
+    // with an empty cache and the outer one is restored afterwards
+    ScopedMap<ExprRef, Value*> OuterCache;
+    std::swap(OuterCache, ValueCache);
 
     // emit loop body
-    if (!Body->codegen()) 
+    if (!codegenExpr(Pool, Pool.operand(E, 3)))
         return nullptr;
 
     // emit step value
-    Value* StepVal = nullptr;
-    if (Step) {
-        StepVal = Step->codegen();
-        if (!StepVal)
-            return nullptr;
+    Value* NextVar;
+    if (IntegerIV) {
+        NextVar = Builder->CreateAdd(IV, StepInt, "nextvar");
     } else {
-        StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+        Value* StepVal = nullptr;
+        if (Step) {
+            StepVal = codegenExpr(Pool, Step);
+            if (!StepVal)
+                return nullptr;
+        } else {
+            StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+        }
+        NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");
     }
 
-    Value* NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");
-
     // computing the end condition
-    Value* EndCond = End->codegen();
+    Value* EndCond = codegenExpr(Pool, Pool.operand(E, 1));
     if (!EndCond)
         return nullptr;
 
@@ -328,34 +982,251 @@ Value* ForExprAST::codegen() {
         BasicBlock::Create(*TheContext, "afterloop", TheFunction);
 
     // insert conditional branch into the end of LoopEndBB
-    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    profileBranch(Builder->CreateCondBr(EndCond, LoopBB, AfterBB), E);
 
     // setting insert point @ AfterBB s.t. new code will be inserted there
     Builder->SetInsertPoint(AfterBB);
+    profileEdge(E, 1);
 
-    Variable->addIncoming(NextVar, LoopEndBB);
+    IV->addIncoming(NextVar, LoopEndBB);
 
-    // restore 'OldVar'
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
+    // restore the shadowed variable
+    NamedValues.popScope();
+    std::swap(OuterCache, ValueCache);
 
     // for expr always returns 0.0
     return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
+
+/**
+ * @brief Collect the names of the variables an expression reads or assigns
+ */
+static void collectVariables(const ExprPool &Pool, ExprRef E,
+                             SmallVectorImpl<Symbol> &Vars) {
+    if (Pool.kind(E) == ExprKind::Variable ||
+        Pool.kind(E) == ExprKind::Assign) {
+        if (!is_contained(Vars, Pool.symbol(E)))
+            Vars.push_back(Pool.symbol(E));
+    }
+    for (ExprRef Op : Pool.operands(E)) {
+        // an omitted 'for' step
+        if (Op != NoExpr)
+            collectVariables(Pool, Op, Vars);
+    }
+}
+
+/**
+ * @brief Codegen for 'parallel for' loops. The body is outlined into a
+ * function running a range of iterations, which the runtime's thread pool
+ * calls in chunks; the call returns once all iterations are done. The
+ * variables the body uses are copied into an environment on the stack.
+ *
+ * Unlike a 'for' loop, the number of iterations is fixed when the loop
+ * starts: the variable takes the values start, start + step, ... up to but
+ * not including end.
+ *
+ * @return Value*
+ */
+static Value* codegenParallelFor(const ExprPool &Pool, ExprRef E) {
+    Symbol VarName = Pool.symbol(E);
+    ExprRef Step = Pool.operand(E, 2);
+    Type* DoubleTy = Builder->getDoubleTy();
+    Type* Int64Ty = Builder->getInt64Ty();
+
+    Value* StartVal = codegenExpr(Pool, Pool.operand(E, 0));
+    Value* EndVal = codegenExpr(Pool, Pool.operand(E, 1));
+    Value* StepVal = Step ? codegenExpr(Pool, Step)
+                          : ConstantFP::get(*TheContext, APFloat(1.0));
+    if (!StartVal || !EndVal || !StepVal)
+        return nullptr;
+
+    // no iterations if the step leads away from the end or anything is NaN.
+    // The count has to be exact even under fast math: a reciprocal step
+    // can round the quotient up past a whole number.
+    Value* Count;
+    {
+        IRBuilder<>::FastMathFlagGuard ExactMath(*Builder);
+        Builder->clearFastMathFlags();
+        Count = Builder->CreateUnaryIntrinsic(
+                Intrinsic::ceil,
+                Builder->CreateFDiv(Builder->CreateFSub(EndVal, StartVal),
+                                    StepVal));
+        Count = Builder->CreateIntrinsic(Intrinsic::fptosi_sat,
+                                         {Int64Ty, DoubleTy}, {Count},
+                                         nullptr, "count");
+    }
+
+    // the environment holds start and step unless they are constants, then
+    // the variables of the enclosing function that the body uses
+    SmallVector<Symbol, 8> Used;
+    collectVariables(Pool, Pool.operand(E, 3), Used);
+    SmallVector<std::pair<Symbol, Value*>, 8> Captures;
+    for (Symbol Name : Used)
+        if (Name != VarName)
+            if (Value* V = NamedValues.lookup(Name))
+                Captures.emplace_back(Name, readVariable(V, Name));
+
+    SmallVector<Value*, 8> EnvVals;
+    if (!isa<Constant>(StartVal))
+        EnvVals.push_back(StartVal);
+    if (!isa<Constant>(StepVal))
+        EnvVals.push_back(StepVal);
+    for (auto &[Name, V] : Captures)
+        EnvVals.push_back(V);
+    ArrayType* EnvTy = ArrayType::get(DoubleTy,
+                                      std::max<size_t>(EnvVals.size(), 1));
+    AllocaInst* Env = createEntryBlockAlloca(EnvTy, "env");
+    for (unsigned i = 0; i < EnvVals.size(); ++i)
+        Builder->CreateStore(EnvVals[i],
+                             Builder->CreateConstInBoundsGEP2_32(EnvTy, Env,
+                                                                 0, i));
+
+    // void body(i64 lo, i64 hi, ptr env) runs iterations [lo, hi)
+    Function* Parent = Builder->GetInsertBlock()->getParent();
+    FunctionType* BodyTy = FunctionType::get(
+            Builder->getVoidTy(), {Int64Ty, Int64Ty, Builder->getPtrTy()},
+            false);
+    Function* BodyFn = Function::Create(BodyTy, Function::InternalLinkage,
+                                        Parent->getName() + ".parbody",
+                                        TheModule.get());
+    Argument* Lo = BodyFn->getArg(0);
+    Argument* Hi = BodyFn->getArg(1);
+    Argument* EnvArg = BodyFn->getArg(2);
+
+    auto SavedIP = Builder->saveIP();
+    BasicBlock* EntryBB = BasicBlock::Create(*TheContext, "entry", BodyFn);
+    BasicBlock* LoopBB = BasicBlock::Create(*TheContext, "loop", BodyFn);
+    BasicBlock* ExitBB = BasicBlock::Create(*TheContext, "exit");
+    Builder->SetInsertPoint(EntryBB);
+
+    unsigned Slot = 0;
+    auto LoadEnv = [&]() {
+        return Builder->CreateLoad(
+                DoubleTy,
+                Builder->CreateConstInBoundsGEP2_32(EnvTy, EnvArg, 0, Slot++));
+    };
+    Value* Start = isa<Constant>(StartVal) ? StartVal : LoadEnv();
+    Value* StepV = isa<Constant>(StepVal) ? StepVal : LoadEnv();
+
+    // the variable is computed in integers when start and step are whole
+    // numbers, like the counter of a 'for' loop
+    Value* StartInt = getIntValue(Pool.operand(E, 0), Start);
+    Value* StepInt = Step ? getIntValue(Step, StepV) : getExactInt(StepV);
+
+    // every variable the body uses is rebound, so nothing of the enclosing
+    // function is referenced from the outlined one
+    NamedValues.pushScope();
+    for (auto &[Name, V] : Captures)
+        NamedValues.insert(Name, LoadEnv());
+    ScopedMap<ExprRef, Value*> OuterCache;
+    std::swap(OuterCache, ValueCache);
+
+    Builder->CreateCondBr(Builder->CreateICmpSLT(Lo, Hi), LoopBB, ExitBB);
+    Builder->SetInsertPoint(LoopBB);
+    PHINode* K = Builder->CreatePHI(Int64Ty, 2, "k");
+    K->addIncoming(Lo, EntryBB);
+
+    // value of the variable in iteration K, exact like the count
+    Value* Variable;
+    if (StartInt && StepInt) {
+        Variable = Builder->CreateSIToFP(
+                Builder->CreateAdd(StartInt, Builder->CreateMul(K, StepInt)),
+                DoubleTy, Symbols.name(VarName));
+    } else {
+        IRBuilder<>::FastMathFlagGuard ExactMath(*Builder);
+        Builder->clearFastMathFlags();
+        Variable = Builder->CreateFAdd(
+                Start,
+                Builder->CreateFMul(Builder->CreateSIToFP(K, DoubleTy), StepV),
+                Symbols.name(VarName));
+    }
+    NamedValues.insert(VarName, Variable);
+
+    bool BodyOk = codegenExpr(Pool, Pool.operand(E, 3)) != nullptr;
+    if (BodyOk) {
+        Value* NextK = Builder->CreateAdd(K, Builder->getInt64(1), "nextk");
+        K->addIncoming(NextK, Builder->GetInsertBlock());
+        Builder->CreateCondBr(Builder->CreateICmpSLT(NextK, Hi), LoopBB,
+                              ExitBB);
+        BodyFn->insert(BodyFn->end(), ExitBB);
+        Builder->SetInsertPoint(ExitBB);
+        Builder->CreateRetVoid();
+    }
+
+    NamedValues.popScope();
+    std::swap(OuterCache, ValueCache);
+    Builder->restoreIP(SavedIP);
+    if (!BodyOk) {
+        delete ExitBB;
+        BodyFn->eraseFromParent();
+        return nullptr;
+    }
+
+    FunctionCallee ParallelFor = TheModule->getOrInsertFunction(
+            "__inhu_parallel_for", Builder->getVoidTy(), Int64Ty,
+            Builder->getPtrTy(), Builder->getPtrTy());
+    Builder->CreateCall(ParallelFor, {Count, BodyFn, Env});
+
+    // like 'for', a parallel loop evaluates to 0.0
+    return Constant::getNullValue(DoubleTy);
+}
+
+Value* codegenExpr(const ExprPool &Pool, ExprRef E) {
+    switch (Pool.kind(E)) {
+        case ExprKind::Number:
+            /* APFloat(Val) --> can hold floating point constant
+             * arbitrary precision
+             */
+            return ConstantFP::get(*TheContext, APFloat(Pool.number(E)));
+        case ExprKind::Variable:
+            return codegenVariable(Pool, E);
+        case ExprKind::Unary:
+            return codegenUnary(Pool, E);
+        case ExprKind::Binary:
+            if (Pool.isPure(E)) {
+                if (Value* V = ValueCache.lookup(E))
+                    return V;
+                Value* V = codegenBinary(Pool, E);
+                if (V)
+                    ValueCache.insert(E, V);
+                return V;
+            }
+            return codegenBinary(Pool, E);
+        case ExprKind::Call:
+            return codegenCall(Pool, E);
+        case ExprKind::If:
+            return codegenIf(Pool, E);
+        case ExprKind::For:
+            return codegenFor(Pool, E);
+        case ExprKind::ParallelFor:
+            return codegenParallelFor(Pool, E);
+        case ExprKind::Index:
+            return codegenIndex(Pool, E);
+        case ExprKind::Store:
+            return codegenStore(Pool, E);
+        case ExprKind::Var:
+            return codegenVar(Pool, E);
+        case ExprKind::Assign:
+            return codegenAssign(Pool, E);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
 /**
  * @brief PrototypeAST constructor definition
  *
  * @param Name 
  * @param Args 
  */
-PrototypeAST::PrototypeAST(const std::string &Name,
-                           std::vector<std::string> Args,
+PrototypeAST::PrototypeAST(Symbol Name,
+                           std::vector<Symbol> Args,
                            bool IsOperator,
-                           unsigned Prec)
+                           unsigned Prec,
+                           bool FastMath,
+                           bool Versioned)
     : Name(Name) , Args(std::move(Args)),
-      IsOperator(IsOperator), Precedence(Prec) {}
+      IsOperator(IsOperator), Precedence(Prec), FastMath(FastMath),
+      Versioned(Versioned) {}
 
 /**
  * @brief PrototypeAST codegen
@@ -369,12 +1240,12 @@ Function* PrototypeAST::codegen() {
                                                Doubles, false);
     Function* Func = Function::Create(FuncType,
                                       Function::ExternalLinkage,
-                                      Name, TheModule.get());
+                                      Symbols.name(Name), TheModule.get());
 
     // set names for all arguments
     unsigned Idx = 0;
     for (auto &Arg : Func->args())
-        Arg.setName(Args[Idx++]);
+        Arg.setName(Symbols.name(Args[Idx++]));
     
     return Func;
 }
@@ -382,9 +1253,16 @@ Function* PrototypeAST::codegen() {
 /**
  * @brief Getting the name of the function prototype
  *
- * @return std::string & Name of the prototype
+ * @return Symbol Interned name of the prototype
+ */
+Symbol PrototypeAST::getName() const { return Name; }
+
+/**
+ * @brief Getting the argument names of the function prototype
+ *
+ * @return std::vector<Symbol> & Interned argument names
  */
-const std::string &PrototypeAST::getName() const { return Name; }
+const std::vector<Symbol> &PrototypeAST::getArgs() const { return Args; }
 
 /**
  * @brief Function to determine if an operator is unary
@@ -411,7 +1289,7 @@ bool PrototypeAST::isBinaryOp() const {
  */
 char PrototypeAST::getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return Name[Name.size()-1];
+    return Symbols.name(Name).back();
 }
 
 /**
@@ -426,44 +1304,167 @@ unsigned PrototypeAST::getBinaryPrecedence() const { return Precedence; }
  *
  * @param PrototypeAST 
  * @param Proto 
+ * @param Pool Pool holding the nodes of Body
  * @param Body 
  */
 FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                         std::unique_ptr<ExprAST> Body)
-    : Proto(std::move(Proto)), Body(std::move(Body)) {}
+                         std::unique_ptr<ExprPool> Pool,
+                         ExprRef Body)
+    : Proto(std::move(Proto)), Pool(std::move(Pool)), Body(Body) {}
 
-Function* FunctionAST::codegen() {
-    auto &P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
-    Function* TheFunction = getFunction(P.getName());
-
-    if (!TheFunction)
-        return nullptr;
+void FunctionAST::declare() const {
+    registerPrototype(std::make_unique<PrototypeAST>(*Proto));
+}
 
-    // if binary operator, create precedence entry
-    if (P.isBinaryOp())
-        BinOpPrec[P.getOperatorName()] = P.getBinaryPrecedence();
+/**
+ * @brief Emit the body of a definition into F
+ *
+ * @param ArgTypes Types of the arguments of a specialized clone, or empty
+ * for the generic version
+ * @return bool False on error, leaving F with a partial body
+ */
+static bool emitBody(const FunctionAST &FnAST, Function* F,
+                     ArrayRef<ValueType> ArgTypes) {
+    const PrototypeAST &P = FnAST.getProto();
+    const ExprPool &Pool = FnAST.getPool();
+    ExprRef Body = FnAST.getBody();
 
     // create a new basic block to start insertion into
-    BasicBlock* BBlock = BasicBlock::Create(*TheContext, "entry", TheFunction);
+    BasicBlock* BBlock = BasicBlock::Create(*TheContext, "entry", F);
     Builder->SetInsertPoint(BBlock);
 
-    // record the function arguments in the NamedValues map
+    // fast math lets the optimizer reassociate, e.g. to vectorize sums,
+    // contract to FMA and multiply by reciprocals. NaNs and infinities keep
+    // their meaning. Without it, no flags are set and results are exact
+    // IEEE arithmetic as before.
+    FastMathFlags FMF;
+    if (Options.FastMath || P.isFastMath()) {
+        FMF.setAllowReassoc();
+        FMF.setNoSignedZeros();
+        FMF.setAllowReciprocal();
+        FMF.setAllowContract();
+        FMF.setApproxFunc();
+    }
+    Builder->setFastMathFlags(FMF);
+
+    // clones are only called directly, so they never switch to the
+    // re-optimized generic version
+    if (ArgTypes.empty())
+        profileFunctionEntry(F);
+
+    std::vector<ValueType> Types = inferTypes(
+            Pool, Body, P.getArgs(),
+            ArgTypes.empty() ? std::vector<ValueType>(P.getArgs().size(),
+                                                      ValueType::Double)
+                             : ArgTypes.vec(),
+            !getFunction(sym_len));
+    CurTypes = &Types;
+
+    TailCalls.clear();
+    collectTailCalls(Pool, Body, TailCalls);
+    bool TailRecursive = any_of(TailCalls, [&](ExprRef E) {
+        return Pool.symbol(E) == P.getName();
+    });
+
+    // record the function arguments in the NamedValues map. Arguments that
+    // are assigned to, or replaced by tail recursion, get a stack slot like
+    // 'var' variables. Integer arguments of clones are bound converted.
     NamedValues.clear();
-    for (auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
+    ValueCache.clear();
+    ArgSlots.clear();
+    unsigned Idx = 0;
+    for (auto &Arg : F->args()) {
+        Symbol Name = P.getArgs()[Idx++];
+        if (!TailRecursive && !Pool.isMutable(Name)) {
+            NamedValues.insert(Name, readVariable(&Arg, Name));
+            continue;
+        }
+        AllocaInst* Slot = createEntryBlockAlloca(Arg.getType(),
+                                                  Symbols.name(Name));
+        Builder->CreateStore(&Arg, Slot);
+        NamedValues.insert(Name, Slot);
+        ArgSlots.push_back(Slot);
+    }
 
-    if (Value* RetVal = Body->codegen()) {
-        // finish function
-        Builder->CreateRet(RetVal);
+    TailRecurseBB = nullptr;
+    if (TailRecursive) {
+        TailRecurseBB = BasicBlock::Create(*TheContext, "tailrecurse", F);
+        Builder->CreateBr(TailRecurseBB);
+        Builder->SetInsertPoint(TailRecurseBB);
+    }
+
+    Value* RetVal = codegenExpr(Pool, Body);
+    CurTypes = nullptr;
+    if (!RetVal)
+        return false;
 
-        // validate generated code
-        verifyFunction(*TheFunction);
-        TheFPM->run(*TheFunction, *TheFAM);
-        return TheFunction;
+    // finish function
+    Builder->CreateRet(RetVal);
+
+    // validate generated code; optimization happens per module
+    verifyFunction(*F);
+    return true;
+}
+
+/**
+ * @brief Generate the body of a clone declared by getSpecializedCallee()
+ */
+static void emitClone(const FunctionAST &FnAST, ArrayRef<ValueType> ArgTypes) {
+    Symbol Name = FnAST.getProto().getName();
+    Function* F = TheModule->getFunction(getSpecializedName(Name, ArgTypes));
+
+    // errors in the body were reported for the generic version already.
+    // The branch counters of a profile belong to the body it was made for,
+    // so clones are not instrumented.
+    std::string Errors;
+    std::string* SavedErrorBuffer = ErrorBuffer;
+    ErrorBuffer = &Errors;
+    ProfileCodegen NoProfile(nullptr, ProfileMode::Instrument);
+    bool Ok = emitBody(FnAST, F, ArgTypes);
+    ErrorBuffer = SavedErrorBuffer;
+    if (Ok) {
+        if (FnAST.getProto().isVersioned())
+            addCPUVersions(*F);
+        return;
+    }
+
+    // forward to the generic version instead, so the module stays valid
+    F->deleteBody();
+    F->setLinkage(Function::InternalLinkage);
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", F));
+    SmallVector<Value*, 8> Args;
+    for (auto &Arg : F->args())
+        Args.push_back(readVariable(&Arg, Name));
+    Builder->CreateRet(Builder->CreateCall(getFunction(Name), Args));
+}
+
+Function* FunctionAST::codegen() {
+    auto &P = *Proto;
+
+    // a module holds at most one body per name
+    Function* TheFunction = TheModule->getFunction(Symbols.name(P.getName()));
+    if (TheFunction && !TheFunction->empty()) {
+        LogErrorV("Function cannot be redefined");
+        return nullptr;
     }
 
+    declare();
+    if (!TheFunction)
+        TheFunction = P.codegen();
+
+    bool Ok = emitBody(*this, TheFunction, {});
+
     // error case reading body -> remove function
-    TheFunction->eraseFromParent();
-    return nullptr;
+    if (!Ok)
+        TheFunction->eraseFromParent();
+    else if (P.isVersioned())
+        addCPUVersions(*TheFunction);
+
+    // the clones specialized for calls in it, and for calls in those
+    while (!PendingClones.empty()) {
+        auto [CloneAST, ArgTypes] = std::move(PendingClones.back());
+        PendingClones.pop_back();
+        emitClone(*CloneAST, ArgTypes);
+    }
+    return Ok ? TheFunction : nullptr;
 }
@@ -1,100 +1,165 @@
 #ifndef my_ast_hpp
 #define my_ast_hpp
     
+#include <atomic>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "llvm_headers.hpp"
+#include "symbol.hpp"
 
-extern std::unique_ptr<llvm::LLVMContext> TheContext;
-extern std::unique_ptr<llvm::Module> TheModule;
-extern std::unique_ptr<llvm::IRBuilder<>> Builder;
-extern std::map<std::string, llvm::Value*> NamedValues;
+// code generation state is per thread, so that definitions can be generated
+// into separate contexts in parallel
+extern thread_local std::unique_ptr<llvm::LLVMContext> TheContext;
+extern thread_local std::unique_ptr<llvm::Module> TheModule;
+extern thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+extern thread_local ScopedSymbolMap<llvm::Value*> NamedValues;
 
-extern std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-extern std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-extern std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-extern std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-extern std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+extern thread_local std::unique_ptr<llvm::ModulePassManager> TheMPM;
+extern thread_local std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+extern thread_local std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+extern thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+extern thread_local std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+extern thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+extern thread_local std::unique_ptr<llvm::StandardInstrumentations> TheSI;
 
 /**
- * @class ExprAst
- * @brief Base class for all expression nodes
- *
+ * @brief Kinds of expression nodes
  */
-class ExprAST{
-public:
-    virtual ~ExprAST() = default;
-    virtual llvm::Value* codegen() = 0; // emit IR for that node
+enum class ExprKind : uint8_t {
+    Number,   // Data: constant pool index
+    Variable, // Data: variable name
+    Unary,    // Oper, operands: {Operand}
+    Binary,   // Oper, operands: {LHS, RHS}
+    Call,     // Data: callee name, operands: arguments
+    If,       // operands: {Cond, Then, Else}
+    For,      // Data: variable name, operands: {Start, End, Step, Body}
+    ParallelFor, // Data: variable name, operands: {Start, End, Step, Body}
+    Index,    // operands: {Array, Index}
+    Store,    // operands: {Array, Index, Value}
+    Var,      // Data: variable name, operands: {Init, Body}
+    Assign    // Data: variable name, operands: {Value}
 };
 
 /**
- * @class NumberExprAST
- * @brief Expression class for referencing a number
- *
+ * @brief Index of a node in an ExprPool. 0 never names a node, so it doubles
+ * as the "no expression" value returned on parse errors and used for an
+ * omitted 'for' step.
  */
-class NumberExprAST : public ExprAST {
-    double Val;
-public: 
-    NumberExprAST(double Val);
-    llvm::Value* codegen() override;
-};
+using ExprRef = uint32_t;
+constexpr ExprRef NoExpr = 0;
 
 /**
- * @class VariableExprAST
- * @brief Expression class for referencing a variable
+ * @struct ExprNode
+ * @brief Fixed-size expression node. Operands are stored contiguously in the
+ * pool's operand array starting at FirstOp.
  *
  */
-class VariableExprAST : public ExprAST {
-    std::string Name;
-public:
-    VariableExprAST(const std::string &Name);
-    llvm::Value* codegen() override;
+struct ExprNode {
+    ExprKind Kind;
+    char Oper;
+    uint16_t NumOps;
+    uint32_t Data;
+    uint32_t FirstOp;
 };
 
 /**
- * @class BinaryExprAST
- * @brief Expression class for binary operations
+ * @class ExprPool
+ * @brief Flat storage for the expressions of one top-level item: an array of
+ * nodes, an array of operand indices and a constant pool. Children are always
+ * added before their parents.
+ *
+ * Pure subtrees (numbers, variables and builtin binary operators over pure
+ * operands) are hash-consed, so structurally identical ones share one node
+ * and the tree is really a DAG.
  *
  */
-class BinaryExprAST : public ExprAST {
-    char Oper;
-    std::unique_ptr<ExprAST> LHS, RHS;
+class ExprPool {
+    using ConsKey = std::pair<uint64_t, uint64_t>;
+
+    std::vector<ExprNode> Nodes;
+    std::vector<ExprRef> Operands;
+    std::vector<double> Constants;
+    llvm::BitVector PureNodes;
+    llvm::DenseMap<ConsKey, ExprRef> ConsTable; // only used while parsing
+    llvm::SmallVector<Symbol, 4> MutableVars;
+
+    ExprRef add(ExprKind Kind, char Oper, uint32_t Data,
+                llvm::ArrayRef<ExprRef> Ops);
+    ExprRef addPure(ConsKey Key, ExprKind Kind, char Oper, uint32_t Data,
+                    llvm::ArrayRef<ExprRef> Ops);
+
 public:
-    BinaryExprAST(char Oper, std::unique_ptr<ExprAST> LHS,
-                             std::unique_ptr<ExprAST> RHS);
-    llvm::Value* codegen() override;
+    // most operands a node can have; NumOps is 16 bits wide
+    static constexpr size_t MaxOperands = UINT16_MAX;
+
+    ExprPool();
+
+    /**
+     * @brief Release the parse-time hash-consing table once the item is
+     * complete. Nodes reading a variable that is declared with 'var' or
+     * assigned to are no longer pure from then on, since their value can
+     * change between two evaluations.
+     */
+    void finish();
+
+    ExprRef addNumber(double Val);
+    ExprRef addVariable(Symbol Name);
+    ExprRef addUnary(char OpCode, ExprRef Operand);
+    ExprRef addBinary(char Oper, ExprRef LHS, ExprRef RHS);
+    ExprRef addCall(Symbol Callee, llvm::ArrayRef<ExprRef> Args);
+    ExprRef addIf(ExprRef Cond, ExprRef Then, ExprRef Else);
+    ExprRef addFor(Symbol VarName, ExprRef Start, ExprRef End, ExprRef Step,
+                   ExprRef Body);
+    ExprRef addParallelFor(Symbol VarName, ExprRef Start, ExprRef End,
+                           ExprRef Step, ExprRef Body);
+    ExprRef addIndex(ExprRef Array, ExprRef Index);
+    ExprRef addStore(ExprRef Array, ExprRef Index, ExprRef Value);
+    ExprRef addVar(Symbol VarName, ExprRef Init, ExprRef Body);
+    ExprRef addAssign(Symbol VarName, ExprRef Value);
+
+    size_t size() const { return Nodes.size(); }
+    const ExprNode &node(ExprRef E) const { return Nodes[E]; }
+    ExprKind kind(ExprRef E) const { return Nodes[E].Kind; }
+    char oper(ExprRef E) const { return Nodes[E].Oper; }
+    Symbol symbol(ExprRef E) const { return Nodes[E].Data; }
+    double number(ExprRef E) const { return Constants[Nodes[E].Data]; }
+    bool isPure(ExprRef E) const { return PureNodes.test(E); }
+
+    /**
+     * @brief Whether a variable of this name is declared with 'var' or
+     * assigned to anywhere in the item
+     */
+    bool isMutable(Symbol Name) const {
+        return llvm::is_contained(MutableVars, Name);
+    }
+
+    llvm::ArrayRef<ExprRef> operands(ExprRef E) const {
+        return llvm::ArrayRef<ExprRef>(Operands).slice(Nodes[E].FirstOp,
+                                                       Nodes[E].NumOps);
+    }
+    ExprRef operand(ExprRef E, unsigned Idx) const {
+        return Operands[Nodes[E].FirstOp + Idx];
+    }
 };
 
 /**
- * @class UnaryExprAST
- * @brief Expression class for unary operations
- *
+ * @brief Whether an operator is one of the builtin binary operators
  */
-class UnaryExprAST : public ExprAST {
-    char OpCode;
-    std::unique_ptr<ExprAST> Operand;
-public:
-    UnaryExprAST(char OpCode, std::unique_ptr<ExprAST> Operand);
-    llvm::Value* codegen() override;
-};
+bool isBuiltinBinOp(char Oper);
 
 /**
- * @class CallExprAST
- * @brief Expression class for function calls
+ * @brief Emit IR for an expression at the current insertion point. Walks the
+ * pool with a switch over the node kinds. Shared pure nodes are emitted once
+ * and reused wherever the earlier value is still available.
  *
+ * @param Pool Pool holding the expression
+ * @param E Expression to emit
+ * @return Value* Result of the expression, or nullptr on error
  */
-class CallExprAST : public ExprAST {
-    std::string Callee; // name of function called
-    std::vector<std::unique_ptr<ExprAST>> Args;  // arguments
-
-public:
-    CallExprAST(const std::string &Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args);
-    llvm::Value* codegen() override;
-};
+llvm::Value* codegenExpr(const ExprPool &Pool, ExprRef E);
 
 /**
  * @class PrototypeAST
@@ -103,26 +168,42 @@ public:
  *
  */
 class PrototypeAST {
-    std::string Name;
-    std::vector<std::string> Args;
+    Symbol Name;
+    std::vector<Symbol> Args;
     bool IsOperator;
     unsigned Precedence;
+    bool FastMath;
+    bool Versioned;
 
 public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-                 bool isOperator = false, unsigned Prec = 0);
+    PrototypeAST(Symbol Name, std::vector<Symbol> Args,
+                 bool isOperator = false, unsigned Prec = 0,
+                 bool FastMath = false, bool Versioned = false);
 
     /* the 'const' after function name indicates that
      * the state of the object will not be changed by
      * calling this function. The function just gets the Name.
      */
     llvm::Function* codegen();
-    const std::string &getName() const;
+    Symbol getName() const;
+    const std::vector<Symbol> &getArgs() const;
 
     bool isUnaryOp() const;
     bool isBinaryOp() const;
     char getOperatorName() const;
     unsigned getBinaryPrecedence() const;
+
+    /**
+     * @brief Whether the definition is annotated with 'fast', allowing its
+     * floating-point math to be reordered as with --fast-math
+     */
+    bool isFastMath() const { return FastMath; }
+
+    /**
+     * @brief Whether the definition is annotated with 'versioned', compiling
+     * it once per x86-64 level with the best one picked at run time
+     */
+    bool isVersioned() const { return Versioned; }
 };
 
 /**
@@ -132,53 +213,51 @@ public:
  */
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    std::unique_ptr<ExprPool> Pool; // holds Body and all of its children
+    ExprRef Body;
 
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                std::unique_ptr<ExprAST> Body);
+                std::unique_ptr<ExprPool> Pool,
+                ExprRef Body);
+
+    /**
+     * @brief Make the function callable from modules generated from now on,
+     * even before its own body has been generated
+     */
+    void declare() const;
     llvm::Function* codegen();
+
+    const PrototypeAST &getProto() const { return *Proto; }
+    const ExprPool &getPool() const { return *Pool; }
+    ExprRef getBody() const { return Body; }
 };
 
 /**
- * @class IfExprAST
- * @brief Class to represent a 'if' conditional expression
- *
+ * @brief Record the prototype of a function so that later modules can
+ * declare it. May be called while other threads generate code.
  */
-class IfExprAST: public ExprAST {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
-public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond,
-              std::unique_ptr<ExprAST> Then,
-              std::unique_ptr<ExprAST> Else);
-
-    llvm::Value* codegen() override;
-};
+void registerPrototype(std::unique_ptr<PrototypeAST> Proto);
 
 /**
- * @class ForExprAST
- * @brief Class to represent a 'for' loop expression
- *
+ * @brief Number of errors reported so far
  */
-class ForExprAST: public ExprAST {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
+extern std::atomic<unsigned> NumErrors;
 
-public:
-    ForExprAST(const std::string &VarName,
-               std::unique_ptr<ExprAST> Start,
-               std::unique_ptr<ExprAST> End,
-               std::unique_ptr<ExprAST> Step,
-               std::unique_ptr<ExprAST> Body);
-    llvm::Value* codegen() override;
-};
+/**
+ * @brief While set, error messages reported on this thread are appended here
+ * instead of being printed, so they can be printed later in order with other
+ * output
+ */
+extern thread_local std::string* ErrorBuffer;
 
 /**
- * @brief Function to display log errors for expression nodes
+ * @brief Function to display log errors for expression nodes. Reports the
+ * location of the current token.
  *
  * @param msg Error message
  */
-std::unique_ptr<ExprAST> LogError(const char* msg);
+ExprRef LogError(const char* msg);
 
 /**
  * @brief Function to display log errors for Prototype nodes
@@ -0,0 +1,248 @@
+#include "consteval.hpp"
+#include <vector>
+
+using namespace llvm;
+
+// expression nodes evaluated before an expression is left to the JIT
+static constexpr unsigned StepBudget = 100000;
+
+// nesting of calls, bounded so deep recursion cannot overflow the stack
+static constexpr unsigned MaxCallDepth = 256;
+
+// pure definitions by name. Only the main thread evaluates, so nothing here
+// is locked.
+static DenseMap<Symbol, std::shared_ptr<FunctionAST>> PureFunctions;
+
+/**
+ * @brief Whether Name is a pure function taking NumArgs arguments. Self is
+ * the definition being checked, which may call itself.
+ */
+static bool isPureCallee(Symbol Name, size_t NumArgs,
+                         const PrototypeAST &Self) {
+    if (Name == Self.getName())
+        return NumArgs == Self.getArgs().size();
+    auto It = PureFunctions.find(Name);
+    return It != PureFunctions.end() &&
+           It->second->getProto().getArgs().size() == NumArgs;
+}
+
+/**
+ * @brief Whether an expression is pure. Also checks everything codegen
+ * checks, so a definition that fails to generate is never taken as pure.
+ *
+ * @param Scope Variables in scope
+ */
+static bool isPureExpr(const ExprPool &Pool, ExprRef E,
+                       std::vector<Symbol> &Scope, const PrototypeAST &Self) {
+    switch (Pool.kind(E)) {
+        case ExprKind::Number:
+            return true;
+        case ExprKind::Variable:
+            return llvm::is_contained(Scope, Pool.symbol(E));
+        case ExprKind::Unary:
+            return isPureCallee(Symbols.opSymbol(false, Pool.oper(E)), 1,
+                                Self) &&
+                   isPureExpr(Pool, Pool.operand(E, 0), Scope, Self);
+        case ExprKind::Binary:
+            if (!isBuiltinBinOp(Pool.oper(E)) &&
+                !isPureCallee(Symbols.opSymbol(true, Pool.oper(E)), 2, Self))
+                return false;
+            return isPureExpr(Pool, Pool.operand(E, 0), Scope, Self) &&
+                   isPureExpr(Pool, Pool.operand(E, 1), Scope, Self);
+        case ExprKind::Call:
+            if (!isPureCallee(Pool.symbol(E), Pool.operands(E).size(), Self))
+                return false;
+            return llvm::all_of(Pool.operands(E), [&](ExprRef Arg) {
+                return isPureExpr(Pool, Arg, Scope, Self);
+            });
+        case ExprKind::If:
+            return llvm::all_of(Pool.operands(E), [&](ExprRef Op) {
+                return isPureExpr(Pool, Op, Scope, Self);
+            });
+        case ExprKind::For: {
+            ExprRef Step = Pool.operand(E, 2);
+            if (!isPureExpr(Pool, Pool.operand(E, 0), Scope, Self))
+                return false;
+            Scope.push_back(Pool.symbol(E));
+            bool Pure = isPureExpr(Pool, Pool.operand(E, 1), Scope, Self) &&
+                        (!Step || isPureExpr(Pool, Step, Scope, Self)) &&
+                        isPureExpr(Pool, Pool.operand(E, 3), Scope, Self);
+            Scope.pop_back();
+            return Pure;
+        }
+        case ExprKind::ParallelFor:
+        case ExprKind::Index:
+        case ExprKind::Store:
+            // the thread pool and arrays are only there at run time
+            return false;
+        case ExprKind::Var:
+        case ExprKind::Assign:
+            // the evaluator binds each name to a single value
+            return false;
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+void addConstEvalDefinition(std::shared_ptr<FunctionAST> FnAST) {
+    const PrototypeAST &P = FnAST->getProto();
+    // the JIT does not take a redefinition either
+    if (PureFunctions.count(P.getName()))
+        return;
+
+    std::vector<Symbol> Scope(P.getArgs());
+    if (isPureExpr(FnAST->getPool(), FnAST->getBody(), Scope, P))
+        PureFunctions[P.getName()] = std::move(FnAST);
+}
+
+// like fcmp one against 0.0, which is how codegen tests conditions
+static bool isTrue(double V) { return V < 0.0 || V > 0.0; }
+
+/**
+ * @class ConstEvaluator
+ * @brief Evaluates expressions over the AST with the same semantics as the
+ * generated code. Gives up on anything that is not pure and once the step
+ * budget is used up.
+ *
+ */
+class ConstEvaluator {
+    std::vector<std::pair<Symbol, double>> Vars; // innermost binding last
+    size_t FrameBase = 0; // first variable of the current call
+    unsigned Steps = 0;
+    unsigned Depth = 0;
+
+    bool call(Symbol Name, ArrayRef<double> Args, double &Result);
+
+public:
+    bool eval(const ExprPool &Pool, ExprRef E, double &Result);
+};
+
+bool ConstEvaluator::call(Symbol Name, ArrayRef<double> Args,
+                          double &Result) {
+    auto It = PureFunctions.find(Name);
+    if (It == PureFunctions.end() || Depth == MaxCallDepth)
+        return false;
+    const FunctionAST &Fn = *It->second;
+    const std::vector<Symbol> &Params = Fn.getProto().getArgs();
+    if (Params.size() != Args.size())
+        return false;
+
+    size_t OuterBase = FrameBase;
+    FrameBase = Vars.size();
+    for (size_t i = 0; i < Args.size(); ++i)
+        Vars.emplace_back(Params[i], Args[i]);
+
+    ++Depth;
+    bool Ok = eval(Fn.getPool(), Fn.getBody(), Result);
+    --Depth;
+
+    Vars.resize(FrameBase);
+    FrameBase = OuterBase;
+    return Ok;
+}
+
+bool ConstEvaluator::eval(const ExprPool &Pool, ExprRef E, double &Result) {
+    if (++Steps > StepBudget)
+        return false;
+
+    switch (Pool.kind(E)) {
+        case ExprKind::Number:
+            Result = Pool.number(E);
+            return true;
+        case ExprKind::Variable:
+            for (size_t i = Vars.size(); i > FrameBase; --i) {
+                if (Vars[i - 1].first == Pool.symbol(E)) {
+                    Result = Vars[i - 1].second;
+                    return true;
+                }
+            }
+            return false;
+        case ExprKind::Unary: {
+            double Operand;
+            return eval(Pool, Pool.operand(E, 0), Operand) &&
+                   call(Symbols.opSymbol(false, Pool.oper(E)), Operand, Result);
+        }
+        case ExprKind::Binary: {
+            double Ops[2];
+            if (!eval(Pool, Pool.operand(E, 0), Ops[0]) ||
+                !eval(Pool, Pool.operand(E, 1), Ops[1]))
+                return false;
+            switch (Pool.oper(E)) {
+                case '+':
+                    Result = Ops[0] + Ops[1];
+                    return true;
+                case '-':
+                    Result = Ops[0] - Ops[1];
+                    return true;
+                case '*':
+                    Result = Ops[0] * Ops[1];
+                    return true;
+                case '/':
+                    Result = Ops[0] / Ops[1];
+                    return true;
+                case '<':
+                    // unordered or less than, like fcmp ult
+                    Result = !(Ops[0] >= Ops[1]) ? 1.0 : 0.0;
+                    return true;
+                default:
+                    return call(Symbols.opSymbol(true, Pool.oper(E)), Ops,
+                                Result);
+            }
+        }
+        case ExprKind::Call: {
+            SmallVector<double, 8> Args;
+            for (ExprRef Arg : Pool.operands(E)) {
+                if (!eval(Pool, Arg, Args.emplace_back()))
+                    return false;
+            }
+            return call(Pool.symbol(E), Args, Result);
+        }
+        case ExprKind::If: {
+            double Cond;
+            if (!eval(Pool, Pool.operand(E, 0), Cond))
+                return false;
+            return eval(Pool, Pool.operand(E, isTrue(Cond) ? 1 : 2), Result);
+        }
+        case ExprKind::For: {
+            ExprRef Step = Pool.operand(E, 2);
+            double Start;
+            if (!eval(Pool, Pool.operand(E, 0), Start))
+                return false;
+
+            // same order as codegen: body, step, then the end condition,
+            // which still sees the current value of the variable
+            Vars.emplace_back(Pool.symbol(E), Start);
+            size_t Var = Vars.size() - 1;
+            while (true) {
+                double Body, StepVal = 1.0, EndCond;
+                if (!eval(Pool, Pool.operand(E, 3), Body) ||
+                    (Step && !eval(Pool, Step, StepVal)))
+                    return false;
+                double Next = Vars[Var].second + StepVal;
+                if (!eval(Pool, Pool.operand(E, 1), EndCond))
+                    return false;
+                Vars[Var].second = Next;
+                if (!isTrue(EndCond))
+                    break;
+            }
+            Vars.pop_back();
+
+            // for expr always returns 0.0
+            Result = 0.0;
+            return true;
+        }
+        case ExprKind::ParallelFor:
+        case ExprKind::Index:
+        case ExprKind::Store:
+        case ExprKind::Var:
+        case ExprKind::Assign:
+            return false;
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+std::optional<double> constEvaluate(const FunctionAST &FnAST) {
+    double Result;
+    if (!ConstEvaluator().eval(FnAST.getPool(), FnAST.getBody(), Result))
+        return std::nullopt;
+    return Result;
+}
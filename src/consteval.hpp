@@ -0,0 +1,27 @@
+#ifndef my_consteval_hpp
+#define my_consteval_hpp
+
+#include <memory>
+#include <optional>
+
+#include "ast.hpp"
+
+/**
+ * @brief Remember a definition for constant evaluation if it is pure, i.e.
+ * its result only depends on its arguments and it only calls itself and
+ * other pure definitions
+ */
+void addConstEvalDefinition(std::shared_ptr<FunctionAST> FnAST);
+
+/**
+ * @brief Evaluate a top-level expression in the frontend, without generating
+ * any code for it
+ *
+ * @param FnAST Anonymous function wrapping the expression
+ * @return std::optional<double> Result, or nothing if the expression may
+ * have side effects, calls anything but pure definitions or takes too long
+ * to evaluate
+ */
+std::optional<double> constEvaluate(const FunctionAST &FnAST);
+
+#endif
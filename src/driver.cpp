@@ -1,80 +1,427 @@
 #include "driver.hpp"
+#include "consteval.hpp"
+#include "interp.hpp"
+#include "profile.hpp"
+#include "types.hpp"
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
 
 using namespace llvm;
 
-extern std::unique_ptr<LLVMContext> TheContext;
-extern std::unique_ptr<Module> TheModule;
-extern std::unique_ptr<IRBuilder<>> Builder;
-extern std::map<std::string, Value*> NamedValues;
-
+DriverOptions Options;
 ExitOnError ExitOnErr;
 std::unique_ptr<orc::KaleidoscopeJIT> TheJIT;
 
+// analyses registered by the pass builder refer back to it, so it has to live
+// as long as the analysis managers
+static thread_local std::unique_ptr<PassBuilder> ThePB;
+
+// target machine used by the optimizer's cost models. TargetMachine caches
+// subtargets without locking, so every thread creates its own.
+static thread_local std::unique_ptr<TargetMachine> TheTM;
+
+// optimized bitcode of every definition handed to the JIT, by function name.
+// Later modules import the bodies they call from here.
+static StringMap<SmallVector<char, 0>> CommittedBitcode;
+static std::mutex CommittedMutex;
+
+// generates and compiles the definitions of a script in the background while
+// the main thread keeps parsing. Not used when running sequentially.
+static std::unique_ptr<ThreadPool> CodegenPool;
+
+// recompiles hot functions with their profiles in profile-guided mode, off
+// the thread running them
+static std::unique_ptr<ThreadPool> TierUpPool;
+
+bool isInteractive() {
+    return !Options.ScriptPath;
+}
+
+CodeGenOpt::Level GetCodeGenOptLevel() {
+    switch (Options.OptLevel.getSpeedupLevel()) {
+        case 0:
+            return CodeGenOpt::None;
+        case 1:
+            return CodeGenOpt::Less;
+        case 2:
+            return CodeGenOpt::Default;
+        default:
+            return CodeGenOpt::Aggressive;
+    }
+}
+
+void SetTargetMachine(std::unique_ptr<TargetMachine> TM) {
+    TheTM = std::move(TM);
+}
+
+TargetMachine &GetTargetMachine() {
+    if (!TheTM)
+        TheTM = ExitOnErr(TheJIT->createTargetMachine());
+    return *TheTM;
+}
+
+/**
+ * @brief Pipeline tuning for an optimization level
+ */
+static PipelineTuningOptions GetTuningOptions(OptimizationLevel Level) {
+    // loop unrolling and the vectorizers only pay off from -O2 on
+    PipelineTuningOptions PTO;
+    bool Aggressive = Level.getSpeedupLevel() > 1;
+    PTO.LoopUnrolling = Aggressive;
+    PTO.LoopInterleaving = Aggressive;
+    PTO.LoopVectorization = Aggressive;
+    PTO.SLPVectorization = Aggressive;
+    return PTO;
+}
+
+/**
+ * @brief Add what the standard pipelines lack for this language. Loops over
+ * arrays get the bounds checks of their main iterations split off before
+ * vectorization, so the vectorizers see loops without early exits.
+ */
+static void RegisterExtraPasses(PassBuilder &PB) {
+    PB.registerVectorizerStartEPCallback(
+            [](FunctionPassManager &FPM, OptimizationLevel Level) {
+                FPM.addPass(IRCEPass());
+            });
+}
+
+/**
+ * @brief Whether the vector versions of libm functions in glibc's libmvec
+ * can be called. Executables get it with -lm; the JIT needs it loaded into
+ * the process.
+ */
+static bool HasVectorMath() {
+    static const bool Loaded = [] {
+        Triple TT(sys::getProcessTriple());
+        if (TT.getArch() != Triple::x86_64 || !TT.isOSLinux() ||
+            !TT.isGNUEnvironment())
+            return false;
+        return !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+    }();
+    return Loaded;
+}
+
+/**
+ * @brief Register the library info the optimizer uses. With --fast-math,
+ * loops calling sin, exp, pow, ... are vectorized with the libmvec versions
+ * of those, which may differ from libm in the last bits.
+ */
+static void RegisterLibraryInfo(FunctionAnalysisManager &FAM) {
+    const Triple &TT = GetTargetMachine().getTargetTriple();
+    TargetLibraryInfoImpl TLII(TT);
+    if (Options.FastMath && HasVectorMath())
+        TLII.addVectorizableFunctionsFromVecLib(
+                TargetLibraryInfoImpl::LIBMVEC_X86, TT);
+
+    // registered first, it takes the place of the pass builder's default
+    FAM.registerPass([TLII] { return TargetLibraryAnalysis(TLII); });
+}
+
 void InitializeModuleAndManagers() {
+    // outer analysis managers hold proxies into the inner ones, so tear the
+    // old ones down from the outside in
+    TheMPM.reset();
+    TheMAM.reset();
+    TheCGAM.reset();
+    TheFAM.reset();
+    TheLAM.reset();
+
     TheContext = std::make_unique<LLVMContext>();
     TheModule = std::make_unique<Module>("My JIT", *TheContext);
-    TheModule->setDataLayout(TheJIT->getDataLayout());
+    TheModule->setDataLayout(GetTargetMachine().createDataLayout());
 
     // creating a new builder for the module
     Builder = std::make_unique<IRBuilder<>>(*TheContext);
 
     // creating new pass and analysis managers
-    TheFPM = std::make_unique<FunctionPassManager>();
+    TheLAM = std::make_unique<LoopAnalysisManager>();
     TheFAM = std::make_unique<FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
     TheMAM = std::make_unique<ModuleAnalysisManager>();
     ThePIC = std::make_unique<PassInstrumentationCallbacks>();
     TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
+    TheMPM = std::make_unique<ModulePassManager>();
 
-    // adding transform passes
-    TheFPM->addPass(InstCombinePass()); // 'peephole' optimizations
-    TheFPM->addPass(ReassociatePass()); // reassociate expr
-    TheFPM->addPass(GVNPass());         // eliminate common subexpressions
-    TheFPM->addPass(SimplifyCFGPass()); // simplify control flow graph
-
-    // register analysis passes used in the transforming passes
-    TheFAM->registerPass([&] {return AAManager(); });
-    TheFAM->registerPass([&] {return AssumptionAnalysis(); });
-    TheFAM->registerPass([&] {return DominatorTreeAnalysis(); });
-    TheFAM->registerPass([&] {return LoopAnalysis(); });
-    TheFAM->registerPass([&] {return MemoryDependenceAnalysis(); });
-    TheFAM->registerPass([&] {return MemorySSAAnalysis(); });
-    TheFAM->registerPass([&] {return OptimizationRemarkEmitterAnalysis(); });
-    TheFAM->registerPass([&] {
-            return OuterAnalysisManagerProxy<ModuleAnalysisManager, Function>(*TheMAM); 
-    });
-    TheFAM->registerPass([&] {
-        return PassInstrumentationAnalysis(ThePIC.get());
-    });
-    TheFAM->registerPass([&] {return TargetIRAnalysis(); });
-    TheFAM->registerPass([&] {return TargetLibraryAnalysis(); });
-    TheMAM->registerPass([&] {return ProfileSummaryAnalysis(); });
+    // -O0 skips the optimizer entirely
+    if (Options.OptLevel == OptimizationLevel::O0)
+        return;
+
+    // register analysis passes used in the transforming passes, using the
+    // JIT's target machine so cost models see the real target
+    ThePB = std::make_unique<PassBuilder>(&GetTargetMachine(),
+                                          GetTuningOptions(Options.OptLevel),
+                                          std::nullopt,
+                                          ThePIC.get());
+    RegisterExtraPasses(*ThePB);
+    RegisterLibraryInfo(*TheFAM);
+    ThePB->registerModuleAnalyses(*TheMAM);
+    ThePB->registerCGSCCAnalyses(*TheCGAM);
+    ThePB->registerFunctionAnalyses(*TheFAM);
+    ThePB->registerLoopAnalyses(*TheLAM);
+    ThePB->crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+
+    // standard per-module pipeline: SROA early on, which promotes the stack
+    // slots of 'var' variables to registers, inlining, LICM, IndVarSimplify,
+    // loop unrolling, loop and SLP vectorization, ...
+    *TheMPM = ThePB->buildPerModuleDefaultPipeline(Options.OptLevel);
 }
 
-void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
+/**
+ * @brief Keep the optimized IR of a definition that is about to be committed
+ * to the JIT, so later modules can import it
+ */
+static void CommitDefinition(Function &F) {
+    if (Options.OptLevel == OptimizationLevel::O0)
+        return;
+    SmallVector<char, 0> Buf;
+    raw_svector_ostream OS(Buf);
+    WriteBitcodeToFile(*F.getParent(), OS);
+
+    std::lock_guard<std::mutex> Guard(CommittedMutex);
+    CommittedBitcode[F.getName()] = std::move(Buf);
+}
+
+/**
+ * @brief Link the bodies of earlier definitions called from the current
+ * module into it, including the ones they call in turn. The imported copies
+ * are available_externally: the inliner can use them, but they are never
+ * emitted again since the JIT already has the real definitions.
+ */
+static void ImportCommittedDefinitions() {
+    std::lock_guard<std::mutex> Guard(CommittedMutex);
+    SmallVector<StringRef, 8> Imported;
+    while (true) {
+        SmallVector<StringRef, 8> Needed;
+        for (Function &F : *TheModule) {
+            auto It = CommittedBitcode.find(F.getName());
+            if (F.isDeclaration() && It != CommittedBitcode.end())
+                Needed.push_back(It->getKey());
+        }
+        if (Needed.empty())
+            break;
+
+        for (StringRef Name : Needed) {
+            // may have come along with an earlier import of this round
+            if (!TheModule->getFunction(Name)->isDeclaration())
+                continue;
+            auto &Buf = CommittedBitcode.find(Name)->second;
+            auto Src = ExitOnErr(parseBitcodeFile(
+                    MemoryBufferRef(StringRef(Buf.data(), Buf.size()), Name),
+                    *TheContext));
+            if (Linker::linkModules(*TheModule, std::move(Src),
+                                    Linker::LinkOnlyNeeded)) {
+                fprintf(stderr, "Error: cannot import '%s'\n",
+                        Name.str().c_str());
+                return;
+            }
+            Imported.push_back(Name);
+        }
+    }
+
+    for (StringRef Name : Imported)
+        if (Function *F = TheModule->getFunction(Name))
+            if (!F->isDeclaration())
+                F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+}
+
+void OptimizeModule() {
+    if (Options.OptLevel == OptimizationLevel::O0)
+        return;
+    ImportCommittedDefinitions();
+    TheMPM->run(*TheModule, *TheMAM);
+
+    // drop cached analyses before the module is handed to the JIT
+    TheMAM->clear();
+}
+
+/**
+ * @brief Run the standard pipeline of an optimization level over a module,
+ * with analysis managers of its own
+ */
+static void RunPipeline(Module &M, OptimizationLevel Level) {
+    // the pass builder goes first so it outlives the managers
+    PassBuilder PB(&GetTargetMachine(), GetTuningOptions(Level));
+    RegisterExtraPasses(PB);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    RegisterLibraryInfo(FAM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PB.buildPerModuleDefaultPipeline(Level).run(M, MAM);
+}
+
+/**
+ * @brief Optimize code right before the JIT compiles it: a function split
+ * off in lazy mode on its first call, and otherwise a module handed over
+ * unoptimized, e.g. a function of the interpreter's that got hot or the
+ * continuation of a hot loop
+ */
+static Expected<orc::ThreadSafeModule>
+OptimizeOnFirstCall(orc::ThreadSafeModule TSM,
+                    orc::MaterializationResponsibility &R) {
+    TSM.withModuleDo([](Module &M) { RunPipeline(M, Options.OptLevel); });
+    return std::move(TSM);
+}
+
+/**
+ * @brief Whether definitions are handed to the JIT unoptimized, to be
+ * optimized only when they are compiled. The JIT then runs
+ * OptimizeOnFirstCall on them.
+ */
+static bool DeferOptimization() {
+    return Options.Lazy || Options.Tiered;
+}
+
+void InitializeLazyOptimizer() {
+    // whole-program mode optimizes the module before it is split up
+    if (DeferOptimization() && !Options.WholeProgram &&
+        Options.OptLevel != OptimizationLevel::O0)
+        TheJIT->setOptimizer(OptimizeOnFirstCall);
+}
+
+void InitializeCodegenPool() {
+    // a single thread is enough to keep up with functions getting hot
+    if (Options.ProfileGuided)
+        TierUpPool = std::make_unique<ThreadPool>(hardware_concurrency(1));
+
+    // the REPL compiles each definition as soon as it is entered, and
+    // whole-program mode needs all of them in a single module
+    if (isInteractive() || Options.WholeProgram || Options.Jobs == 1)
+        return;
+    CodegenPool = std::make_unique<ThreadPool>(
+            hardware_concurrency(Options.Jobs));
+}
+
+void WaitForDefinitions() {
+    if (CodegenPool)
+        CodegenPool->wait();
+}
+
+/**
+ * @brief Generate a definition into the calling thread's module, optimize it
+ * and hand it to the JIT. Leaves a fresh module behind.
+ */
+static void CompileDefinition(FunctionAST &FnAST) {
+    // in profile-guided mode the first compile is instrumented
+    ProfileCodegen Instrument(
+            Options.ProfileGuided ? getProfile(FnAST.getProto().getName())
+                                  : nullptr,
+            ProfileMode::Instrument);
+    if (auto *FnIR = FnAST.codegen()) {
+      // in lazy and tiered mode the JIT optimizes each function when it
+      // compiles it
+      if (!DeferOptimization())
+        OptimizeModule();
+      if (isInteractive()) {
+        fprintf(stderr, "Read function definition:");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+      }
+      // instrumented bodies are not worth inlining, only the recompiled ones
+      if (!DeferOptimization() && !Options.ProfileGuided)
+        CommitDefinition(*FnIR);
       ExitOnErr(TheJIT->addModule(
                   orc::ThreadSafeModule(std::move(TheModule),
                                         std::move(TheContext))));
       InitializeModuleAndManagers();
     }
+}
+
+void HandleDefinition() {
+  if (std::shared_ptr<FunctionAST> FnAST = ParseDefinition()) {
+    addConstEvalDefinition(FnAST);
+    addSpecializableDefinition(FnAST);
+    if (Options.ProfileGuided)
+      addProfiledDefinition(FnAST);
+    if (Options.Tiered)
+      addInterpDefinition(FnAST);
+    if (!CodegenPool) {
+      CompileDefinition(*FnAST);
+      return;
+    }
+
+    // declare it right away so that items parsed next can call it, then
+    // generate it on a worker thread with that thread's own context
+    FnAST->declare();
+    CodegenPool->async([FnAST] {
+      if (!TheModule)
+        InitializeModuleAndManagers();
+      CompileDefinition(*FnAST);
+    });
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
+/**
+ * @brief Recompile a hot function at -O3 with the counts of its profile and
+ * redirect its instrumented code to the result
+ */
+static void RecompileHot(FunctionProfile &P) {
+    if (!TheModule)
+        InitializeModuleAndManagers();
+
+    Function* FnIR;
+    {
+        ProfileCodegen Apply(&P, ProfileMode::Apply);
+        FnIR = P.AST->codegen();
+    }
+    if (!FnIR)
+        return;
+
+    // bodies of earlier hot functions can be inlined, and the summary lets
+    // the inliner and block placement tell hot code from cold
+    ImportCommittedDefinitions();
+    setProfileSummary(*TheModule);
+    RunPipeline(*TheModule, OptimizationLevel::O3);
+
+    // modules with different summaries cannot be linked, so the committed
+    // copy goes without one. Later modules import it under its own name,
+    // but the instrumented definition already has that name in the JIT.
+    if (NamedMDNode* Flags = TheModule->getModuleFlagsMetadata())
+        TheModule->eraseNamedMetadata(Flags);
+    CommitDefinition(*FnIR);
+    std::string Name = FnIR->getName().str() + ".hot";
+    FnIR->setName(Name);
+
+    ExitOnErr(TheJIT->addModule(
+                orc::ThreadSafeModule(std::move(TheModule),
+                                      std::move(TheContext))));
+    InitializeModuleAndManagers();
+    auto Sym = ExitOnErr(TheJIT->lookup(Name));
+    P.Optimized.store(Sym.getAddress().toPtr<void*>(),
+                      std::memory_order_release);
+}
+
+void TierUp(FunctionProfile &P) {
+    TierUpPool->async([&P] { RecompileHot(P); });
+}
+
+void StopTierUp() {
+    TierUpPool.reset();
+}
+
 void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
     if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      if (isInteractive()) {
+        fprintf(stderr, "Read extern: ");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+      }
+      if (Options.Tiered)
+        addInterpExtern(*ProtoAST);
+      registerPrototype(std::move(ProtoAST));
     }
   } else {
     // Skip token for error recovery.
@@ -82,42 +429,154 @@ void HandleExtern() {
   }
 }
 
-void HandleTopLevelExpression() {
-// Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (FnAST->codegen()) {
+/**
+ * @struct PendingExpr
+ * @brief Top-level expression of a script that has been generated but not run
+ * yet. Messages reported after it was read are printed after its result.
+ *
+ */
+struct PendingExpr {
+    Symbol Thunk;
+    std::optional<double> Value; // already known, the thunk is not generated
+    std::string Messages;
+};
+
+// consecutive top-level expressions of a script share one module and are run
+// together, so they pay for a single compile and link instead of one each
+static std::vector<PendingExpr> PendingExprs;
+static constexpr size_t MaxPendingExprs = 1024;
 
-            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-            auto TSM = orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+void FlushExpressions() {
+    if (PendingExprs.empty())
+        return;
+    ErrorBuffer = nullptr;
 
-            ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-            InitializeModuleAndManagers();
+    orc::ResourceTrackerSP RT;
+    if (llvm::any_of(PendingExprs, [](auto &E) { return !E.Value; })) {
+        // everything they may call has to be in the JIT before they run
+        WaitForDefinitions();
+        OptimizeModule();
 
-            auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+        RT = TheJIT->getMainJITDylib().createResourceTracker();
+        ExitOnErr(TheJIT->addModule(
+                    orc::ThreadSafeModule(std::move(TheModule),
+                                          std::move(TheContext)), RT));
+        InitializeModuleAndManagers();
+    }
 
+    for (auto &E : PendingExprs) {
+        if (!E.Value) {
+            auto ExprSymbol = ExitOnErr(TheJIT->lookup(Symbols.name(E.Thunk)));
             double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-            fprintf(stderr, "Evaluated to %f\n", FP());
-            ExitOnErr(RT->remove());
+            E.Value = FP();
         }
-    } else {
+        fprintf(stderr, "Evaluated to %f\n", *E.Value);
+        fputs(E.Messages.c_str(), stderr);
+    }
+    PendingExprs.clear();
+    if (RT)
+        ExitOnErr(RT->remove());
+}
+
+/**
+ * @brief Append an expression to the current batch. Messages reported from
+ * now on are printed after its result.
+ */
+static void AddPendingExpr(Symbol Thunk, std::optional<double> Value) {
+    PendingExprs.push_back({Thunk, Value, std::string()});
+    ErrorBuffer = &PendingExprs.back().Messages;
+    if (PendingExprs.size() == MaxPendingExprs)
+        FlushExpressions();
+}
+
+/**
+ * @brief Add a top-level expression of a script to the current batch as its
+ * own thunk. It runs once the batch is flushed.
+ */
+static void QueueTopLevelExpression(FunctionAST &FnAST, Symbol Name) {
+    if (FnAST.codegen())
+        AddPendingExpr(Name, std::nullopt);
+}
+
+/**
+ * @brief Compile and run a single top-level expression right away
+ */
+static void EvaluateTopLevelExpression(FunctionAST &FnAST) {
+    // everything it may call has to be in the JIT before it runs
+    WaitForDefinitions();
+    if (FnAST.codegen()) {
+        OptimizeModule();
+
+        auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+        auto TSM = orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+
+        ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+        InitializeModuleAndManagers();
+
+        auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+
+        double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
+        fprintf(stderr, "Evaluated to %f\n", FP());
+        ExitOnErr(RT->remove());
+    }
+}
+
+void HandleTopLevelExpression() {
+    // expressions of a script are batched, each into its own thunk
+    Symbol Name = isInteractive()
+            ? Symbol(sym_anon_expr)
+            : Symbols.intern("__anon_expr." + std::to_string(PendingExprs.size()));
+
+    auto FnAST = ParseTopLevelExpr(Name);
+    if (!FnAST) {
         // Skip token for error recovery.
         getNextToken();
+        return;
     }
+
+    // constant expressions and calls of pure functions with constant
+    // arguments need no code at all
+    if (auto Result = constEvaluate(*FnAST)) {
+        if (PendingExprs.empty())
+            fprintf(stderr, "Evaluated to %f\n", *Result);
+        else
+            AddPendingExpr(Name, Result);
+        return;
+    }
+
+    if (Options.Tiered) {
+        // anything still batched has to run first
+        FlushExpressions();
+        if (auto Result = interpretTopLevelExpression(*FnAST)) {
+            fprintf(stderr, "Evaluated to %f\n", *Result);
+            return;
+        }
+    }
+
+    if (isInteractive())
+        EvaluateTopLevelExpression(*FnAST);
+    else
+        QueueTopLevelExpression(*FnAST, Name);
 }
 
 void MainLoop() {
     while (true) {
-        fprintf(stderr, ">>> ");
+        if (isInteractive())
+            fprintf(stderr, ">>> ");
         switch (CurTok) {
             case token_eof:
+                FlushExpressions();
+                WaitForDefinitions();
                 return;
             case ';': // ignore top-level semicolons
                 getNextToken();
                 break;
             case token_def:
+                FlushExpressions();
                 HandleDefinition();
                 break;
             case token_extern:
+                FlushExpressions();
                 HandleExtern();
                 break;
             default:
@@ -126,3 +585,59 @@ void MainLoop() {
         }
     }
 }
+
+std::vector<Symbol> GenerateProgram(GlobalValue::LinkageTypes DefLinkage) {
+    // each top-level expression becomes its own thunk, run after compilation
+    std::vector<Symbol> Thunks;
+
+    while (CurTok != token_eof) {
+        switch (CurTok) {
+            case ';': // ignore top-level semicolons
+                getNextToken();
+                break;
+            case token_def:
+                if (std::shared_ptr<FunctionAST> FnAST = ParseDefinition()) {
+                    addSpecializableDefinition(FnAST);
+                    if (auto *FnIR = FnAST->codegen())
+                        FnIR->setLinkage(DefLinkage);
+                } else {
+                    getNextToken();
+                }
+                break;
+            case token_extern:
+                HandleExtern();
+                break;
+            default: {
+                Symbol Name = Symbols.intern(
+                        "__anon_expr." + std::to_string(Thunks.size()));
+                if (auto FnAST = ParseTopLevelExpr(Name)) {
+                    if (FnAST->codegen())
+                        Thunks.push_back(Name);
+                } else {
+                    getNextToken();
+                }
+                break;
+            }
+        }
+    }
+    return Thunks;
+}
+
+void RunWholeProgram() {
+    // nothing outside this module can call the definitions, which lets the
+    // optimizer inline, specialize and drop them freely
+    std::vector<Symbol> Thunks =
+            GenerateProgram(GlobalValue::InternalLinkage);
+
+    OptimizeModule();
+    ExitOnErr(TheJIT->addModule(
+                orc::ThreadSafeModule(std::move(TheModule),
+                                      std::move(TheContext))));
+    InitializeModuleAndManagers();
+
+    for (Symbol Name : Thunks) {
+        auto ExprSymbol = ExitOnErr(TheJIT->lookup(Symbols.name(Name)));
+        double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
+        fprintf(stderr, "Evaluated to %f\n", FP());
+    }
+}
@@ -2,14 +2,102 @@
 #define my_driver_hpp
 
 #include "parser.hpp"
+#include <vector>
+
+struct FunctionProfile;
+
+/**
+ * @struct DriverOptions
+ * @brief Options taken from the command line
+ *
+ */
+struct DriverOptions {
+    const char* ScriptPath = nullptr; // run this file instead of the REPL
+    llvm::OptimizationLevel OptLevel = llvm::OptimizationLevel::O2;
+    bool WholeProgram = false; // compile the script as a single module
+    bool Lazy = false;         // compile functions on their first call
+    bool Tiered = false;       // interpret code until it gets hot
+    bool ProfileGuided = false; // instrument, then re-optimize hot code
+    bool FastMath = false;     // let floating-point math be reordered
+    unsigned Jobs = 0;         // codegen threads for scripts, 0 = all cores
+    unsigned LoopThreads = 0;  // threads running 'parallel for', 0 = default
+    const char* CacheDir = nullptr; // on-disk object cache, if any
+    const char* CPU = nullptr; // --mcpu, default: host (JIT), generic (-c)
+    const char* Features = nullptr; // --mattr, e.g. "+avx2,-avx512f"
+    bool EmitObject = false;   // -c: compile to an object file
+    bool EmitExe = false;      // --emit-exe: compile and link an executable
+    const char* OutputPath = nullptr; // -o
+};
+
+extern DriverOptions Options;
 extern llvm::ExitOnError ExitOnErr;
 extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
 
+/**
+ * @brief Whether the driver is running an interactive session, i.e. no
+ * script file was given. Prompts and IR echoes are only shown then.
+ */
+bool isInteractive();
+
+/**
+ * @brief Backend optimization level matching the -O level
+ */
+llvm::CodeGenOpt::Level GetCodeGenOptLevel();
+
+/**
+ * @brief Target machine of the calling thread, used for the data layout and
+ * the optimizer's cost models. Defaults to one for the JIT's target.
+ */
+llvm::TargetMachine &GetTargetMachine();
+
+/**
+ * @brief Use a specific target machine on the calling thread, e.g. when
+ * compiling ahead of time
+ */
+void SetTargetMachine(std::unique_ptr<llvm::TargetMachine> TM);
+
 /**
  * @brief Function to initialize a new context and module
  */
 void InitializeModuleAndManagers();
 
+/**
+ * @brief Function to run the optimization pipeline for the selected -O level
+ * over the current module. Bodies of earlier definitions it calls are
+ * imported first so they can be inlined. Does nothing at -O0.
+ */
+void OptimizeModule();
+
+/**
+ * @brief Function to install the per-function optimizer used by the JIT in
+ * lazy mode. Does nothing in the other modes.
+ */
+void InitializeLazyOptimizer();
+
+/**
+ * @brief Function to start the worker threads that generate and compile the
+ * definitions of a script in parallel, unless running sequentially
+ */
+void InitializeCodegenPool();
+
+/**
+ * @brief Function to block until every definition handed to the worker
+ * threads is in the JIT. Returns right away when running sequentially.
+ */
+void WaitForDefinitions();
+
+/**
+ * @brief Function to recompile a hot function at -O3 with its profile on a
+ * background thread. Calls to it switch over once that is done.
+ */
+void TierUp(FunctionProfile &P);
+
+/**
+ * @brief Function to wait for the recompilations in flight and stop
+ * tiering up. No instrumented code may run afterwards.
+ */
+void StopTierUp();
+
 /**
  * @brief Function to handle 'def'
  */
@@ -21,13 +109,37 @@ void HandleDefinition();
 void HandleExtern();
 
 /**
- * @brief Function to handle top-level expressions
+ * @brief Function to handle top-level expressions. Expressions of a script
+ * are batched and only run by FlushExpressions().
  */
 void HandleTopLevelExpression();
 
+/**
+ * @brief Compile and run the batched top-level expressions of a script, in
+ * order, printing their results
+ */
+void FlushExpressions();
+
 /**
  * @brief The main loop of the program
  */
 void MainLoop();
 
+/**
+ * @brief Parse the whole input and generate all of it into the current
+ * module. Each top-level expression becomes an external thunk named
+ * __anon_expr.N.
+ *
+ * @param DefLinkage Linkage given to the definitions
+ * @return std::vector<Symbol> Names of the thunks, in source order
+ */
+std::vector<Symbol> GenerateProgram(llvm::GlobalValue::LinkageTypes DefLinkage);
+
+/**
+ * @brief Run the whole input as one program: parse every item and generate
+ * all definitions into a single module, optimize it as a unit, then evaluate
+ * the top-level expressions in source order
+ */
+void RunWholeProgram();
+
 #endif
@@ -0,0 +1,544 @@
+#include "interp.hpp"
+#include "driver.hpp"
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+// calls plus loop iterations after which a function is compiled
+static constexpr unsigned HotThreshold = 1000;
+
+// iterations of one loop in a single activation after which the rest of the
+// loop is compiled
+static constexpr unsigned LoopThreshold = 1000;
+
+// compiled code is called through typed function pointers, which exist for
+// up to this many arguments
+static constexpr unsigned MaxNativeArgs = 8;
+
+/**
+ * @brief Bytecode instructions. Operands and results live on a value stack,
+ * variables in numbered slots of the frame.
+ */
+enum class Opcode : uint8_t {
+    Const,       // push Constants[Arg]
+    Load,        // push slot Arg
+    Store,       // pop into slot Arg
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Less,
+    Call,        // replace the arguments on top with the result of Callees[Arg]
+    Jump,        // continue at Arg
+    JumpIfFalse, // pop, continue at Arg unless the value is true
+    LoopBack,    // pop, continue at the head of Loops[Arg] if the value is true
+    Pop,
+    Ret
+};
+
+struct Instr {
+    Opcode Op;
+    uint32_t Arg;
+};
+
+struct InterpFunction;
+
+/**
+ * @struct InterpLoop
+ * @brief A 'for' loop in bytecode, with what is needed to continue it in
+ * compiled code
+ *
+ */
+struct InterpLoop {
+    ExprRef For;
+    uint32_t Head;
+    std::vector<std::pair<Symbol, unsigned>> Live; // variables in scope, slots
+    void* Entry = nullptr; // compiled rest of the loop
+    bool Failed = false;
+};
+
+/**
+ * @struct Bytecode
+ * @brief Translation of a function body for the interpreter
+ *
+ */
+struct Bytecode {
+    const FunctionAST* Source = nullptr;
+    InterpFunction* Owner = nullptr; // null for top-level expressions
+    std::vector<Instr> Instrs;
+    std::vector<double> Constants;
+    std::vector<InterpFunction*> Callees;
+    std::vector<InterpLoop> Loops;
+    unsigned NumSlots = 0;
+    unsigned MaxStack = 0;
+};
+
+/**
+ * @struct InterpFunction
+ * @brief A function as seen by the interpreter. Definitions run as bytecode
+ * until they are hot; externs and hot definitions run natively.
+ *
+ */
+struct InterpFunction {
+    Symbol Name;
+    unsigned NumArgs;
+    std::shared_ptr<FunctionAST> AST; // null for externs
+    std::unique_ptr<Bytecode> Code;
+    bool Prepared = false; // callees have been checked
+    bool Broken = false;   // cannot be interpreted
+    void* Native = nullptr;
+    unsigned Hotness = 0;
+};
+
+// every function that interpreted code may call, by name. Only the main
+// thread interprets, so nothing here is locked.
+static DenseMap<Symbol, std::unique_ptr<InterpFunction>> InterpFunctions;
+static unsigned NumLoopEntries;
+
+/**
+ * @class BytecodeCompiler
+ * @brief Translates the body of a function into bytecode. Fails on anything
+ * codegen would reject and on calls the interpreter cannot make, so that a
+ * prepared function never fails while it runs.
+ *
+ */
+class BytecodeCompiler {
+    const ExprPool &Pool;
+    Bytecode &Code;
+    std::vector<std::pair<Symbol, unsigned>> Scope; // innermost binding last
+    int Depth = 0;
+
+    uint32_t size() const { return Code.Instrs.size(); }
+
+    void emit(Opcode Op, uint32_t Arg, int StackEffect) {
+        Code.Instrs.push_back(Instr{Op, Arg});
+        Depth += StackEffect;
+        Code.MaxStack = std::max<unsigned>(Code.MaxStack, Depth);
+    }
+
+    void emitConst(double Val) {
+        Code.Constants.push_back(Val);
+        emit(Opcode::Const, Code.Constants.size() - 1, 1);
+    }
+
+    /**
+     * @brief Index of a callee in Code.Callees, or -1 if there is no
+     * function of that name taking NumArgs arguments
+     */
+    int resolve(Symbol Name, size_t NumArgs) {
+        auto It = InterpFunctions.find(Name);
+        if (It == InterpFunctions.end() || It->second->NumArgs != NumArgs)
+            return -1;
+        Code.Callees.push_back(It->second.get());
+        return Code.Callees.size() - 1;
+    }
+
+    void emitCall(int Callee, size_t NumArgs) {
+        emit(Opcode::Call, Callee, 1 - (int)NumArgs);
+    }
+
+    bool emitFor(ExprRef E);
+    bool emitExpr(ExprRef E);
+
+public:
+    explicit BytecodeCompiler(Bytecode &Code)
+        : Pool(Code.Source->getPool()), Code(Code) {
+        for (Symbol Arg : Code.Source->getProto().getArgs())
+            Scope.emplace_back(Arg, Code.NumSlots++);
+    }
+
+    bool compile() {
+        if (!emitExpr(Code.Source->getBody()))
+            return false;
+        emit(Opcode::Ret, 0, -1);
+        return true;
+    }
+};
+
+bool BytecodeCompiler::emitFor(ExprRef E) {
+    Symbol VarName = Pool.symbol(E);
+    ExprRef Step = Pool.operand(E, 2);
+
+    if (!emitExpr(Pool.operand(E, 0)))
+        return false;
+    unsigned VarSlot = Code.NumSlots++;
+    unsigned NextSlot = Code.NumSlots++;
+    emit(Opcode::Store, VarSlot, -1);
+    Scope.emplace_back(VarName, VarSlot);
+
+    unsigned LoopIdx = Code.Loops.size();
+    Code.Loops.emplace_back();
+    Code.Loops[LoopIdx].For = E;
+    Code.Loops[LoopIdx].Head = size();
+    for (auto It = Scope.rbegin(); It != Scope.rend(); ++It) {
+        auto &Live = Code.Loops[LoopIdx].Live;
+        if (llvm::none_of(Live, [&](auto &L) { return L.first == It->first; }))
+            Live.push_back(*It);
+    }
+
+    // same order as codegen: body, step, then the end condition, which still
+    // sees the current value of the variable
+    if (!emitExpr(Pool.operand(E, 3)))
+        return false;
+    emit(Opcode::Pop, 0, -1);
+    emit(Opcode::Load, VarSlot, 1);
+    if (Step) {
+        if (!emitExpr(Step))
+            return false;
+    } else {
+        emitConst(1.0);
+    }
+    emit(Opcode::Add, 0, -1);
+    emit(Opcode::Store, NextSlot, -1);
+    if (!emitExpr(Pool.operand(E, 1)))
+        return false;
+    emit(Opcode::Load, NextSlot, 1);
+    emit(Opcode::Store, VarSlot, -1);
+    emit(Opcode::LoopBack, LoopIdx, -1);
+    Scope.pop_back();
+
+    // for expr always returns 0.0
+    emitConst(0.0);
+    return true;
+}
+
+bool BytecodeCompiler::emitExpr(ExprRef E) {
+    switch (Pool.kind(E)) {
+        case ExprKind::Number:
+            emitConst(Pool.number(E));
+            return true;
+        case ExprKind::Variable:
+            for (auto It = Scope.rbegin(); It != Scope.rend(); ++It) {
+                if (It->first == Pool.symbol(E)) {
+                    emit(Opcode::Load, It->second, 1);
+                    return true;
+                }
+            }
+            return false;
+        case ExprKind::Unary: {
+            int Callee = resolve(Symbols.opSymbol(false, Pool.oper(E)), 1);
+            if (Callee < 0 || !emitExpr(Pool.operand(E, 0)))
+                return false;
+            emitCall(Callee, 1);
+            return true;
+        }
+        case ExprKind::Binary: {
+            static const std::pair<char, Opcode> Builtins[] = {
+                {'+', Opcode::Add}, {'-', Opcode::Sub}, {'*', Opcode::Mul},
+                {'/', Opcode::Div}, {'<', Opcode::Less}
+            };
+            char Oper = Pool.oper(E);
+            int Callee = -1;
+            if (!isBuiltinBinOp(Oper)) {
+                Callee = resolve(Symbols.opSymbol(true, Oper), 2);
+                if (Callee < 0)
+                    return false;
+            }
+            if (!emitExpr(Pool.operand(E, 0)) || !emitExpr(Pool.operand(E, 1)))
+                return false;
+            if (Callee >= 0) {
+                emitCall(Callee, 2);
+                return true;
+            }
+            for (auto &[C, Op] : Builtins)
+                if (C == Oper)
+                    emit(Op, 0, -1);
+            return true;
+        }
+        case ExprKind::Call: {
+            ArrayRef<ExprRef> Args = Pool.operands(E);
+            int Callee = resolve(Pool.symbol(E), Args.size());
+            if (Callee < 0)
+                return false;
+            for (ExprRef Arg : Args)
+                if (!emitExpr(Arg))
+                    return false;
+            emitCall(Callee, Args.size());
+            return true;
+        }
+        case ExprKind::If: {
+            if (!emitExpr(Pool.operand(E, 0)))
+                return false;
+            uint32_t ToElse = size();
+            emit(Opcode::JumpIfFalse, 0, -1);
+            if (!emitExpr(Pool.operand(E, 1)))
+                return false;
+            uint32_t ToEnd = size();
+            emit(Opcode::Jump, 0, 0);
+
+            // the else branch starts without the value of the then branch
+            --Depth;
+            Code.Instrs[ToElse].Arg = size();
+            if (!emitExpr(Pool.operand(E, 2)))
+                return false;
+            Code.Instrs[ToEnd].Arg = size();
+            return true;
+        }
+        case ExprKind::For:
+            return emitFor(E);
+        case ExprKind::ParallelFor:
+        case ExprKind::Index:
+        case ExprKind::Store:
+            // parallel loops and arrays are left to compiled code
+            return false;
+        case ExprKind::Var:
+        case ExprKind::Assign:
+            // so are mutable variables, since a loop continuing in compiled
+            // code could not hand assigned values back
+            return false;
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+void addInterpDefinition(std::shared_ptr<FunctionAST> FnAST) {
+    const PrototypeAST &P = FnAST->getProto();
+    auto &F = InterpFunctions[P.getName()];
+    if (!F)
+        F = std::make_unique<InterpFunction>();
+    else if (F->Code)
+        return; // the JIT does not take a redefinition of it either
+
+    F->Name = P.getName();
+    F->NumArgs = P.getArgs().size();
+    F->AST = std::move(FnAST);
+
+    // callees are resolved now, like codegen does, so only functions known
+    // at this point can be called
+    F->Code = std::make_unique<Bytecode>();
+    F->Code->Source = F->AST.get();
+    F->Code->Owner = F.get();
+    F->Broken = !BytecodeCompiler(*F->Code).compile();
+    if (F->Broken)
+        F->Code.reset();
+}
+
+void addInterpExtern(const PrototypeAST &Proto) {
+    auto &F = InterpFunctions[Proto.getName()];
+    if (F)
+        return;
+    F = std::make_unique<InterpFunction>();
+    F->Name = Proto.getName();
+    F->NumArgs = Proto.getArgs().size();
+}
+
+/**
+ * @brief Check that everything a function may call can be called from
+ * interpreted code. Functions that cannot are remembered as such.
+ *
+ * @return bool Whether the function can be called from interpreted code
+ */
+static bool prepare(InterpFunction &F);
+
+static bool prepareCallees(const Bytecode &Code) {
+    return llvm::all_of(Code.Callees,
+                        [](InterpFunction* Callee) { return prepare(*Callee); });
+}
+
+static bool prepare(InterpFunction &F) {
+    if (F.Native || F.Prepared)
+        return true;
+    if (!F.AST)
+        return F.NumArgs <= MaxNativeArgs;
+    if (F.Broken)
+        return false;
+
+    // set before the callees are prepared, which may lead back here
+    F.Prepared = true;
+    if (!prepareCallees(*F.Code)) {
+        F.Prepared = false;
+        F.Broken = true;
+        return false;
+    }
+    return true;
+}
+
+template <size_t... I>
+static double callNative(void* Addr, const double* Args,
+                         std::index_sequence<I...>) {
+    using FnTy = double (*)(decltype((void)I, 0.0)...);
+    return reinterpret_cast<FnTy>(Addr)(Args[I]...);
+}
+
+/**
+ * @brief Call compiled code taking NumArgs doubles
+ */
+static double callNative(void* Addr, unsigned NumArgs, const double* Args) {
+    switch (NumArgs) {
+        case 0: return callNative(Addr, Args, std::make_index_sequence<0>());
+        case 1: return callNative(Addr, Args, std::make_index_sequence<1>());
+        case 2: return callNative(Addr, Args, std::make_index_sequence<2>());
+        case 3: return callNative(Addr, Args, std::make_index_sequence<3>());
+        case 4: return callNative(Addr, Args, std::make_index_sequence<4>());
+        case 5: return callNative(Addr, Args, std::make_index_sequence<5>());
+        case 6: return callNative(Addr, Args, std::make_index_sequence<6>());
+        case 7: return callNative(Addr, Args, std::make_index_sequence<7>());
+        case 8: return callNative(Addr, Args, std::make_index_sequence<8>());
+    }
+    llvm_unreachable("too many arguments for a native call");
+}
+
+/**
+ * @brief Address of a function in the JIT, compiling it if necessary
+ */
+static void* lookupNative(Symbol Name) {
+    // definitions may still be on their way to the JIT
+    WaitForDefinitions();
+    auto Sym = ExitOnErr(TheJIT->lookup(Symbols.name(Name)));
+    return Sym.getAddress().toPtr<void*>();
+}
+
+/**
+ * @brief Compile the remaining iterations of a hot loop into a function of
+ * the variables in scope, so the running activation can continue there.
+ * The value of a loop is always 0, which lets the interpreter carry on
+ * right after it once that function returns.
+ */
+static void* compileLoopEntry(const Bytecode &Code, InterpLoop &L) {
+    if (L.Live.size() > MaxNativeArgs) {
+        L.Failed = true;
+        return nullptr;
+    }
+
+    // the loop variable already holds the value for the next iteration
+    const ExprPool &Pool = Code.Source->getPool();
+    auto EntryPool = std::make_unique<ExprPool>(Pool);
+    Symbol VarName = Pool.symbol(L.For);
+    ExprRef Loop = EntryPool->addFor(VarName, EntryPool->addVariable(VarName),
+                                     Pool.operand(L.For, 1),
+                                     Pool.operand(L.For, 2),
+                                     Pool.operand(L.For, 3));
+    EntryPool->finish();
+
+    std::vector<Symbol> Params;
+    for (auto &[Name, Slot] : L.Live)
+        Params.push_back(Name);
+    Symbol Name = Symbols.intern("__osr." + std::to_string(NumLoopEntries++));
+    FunctionAST FnAST(std::make_unique<PrototypeAST>(Name, std::move(Params)),
+                      std::move(EntryPool), Loop);
+
+    if (!FnAST.codegen()) {
+        L.Failed = true;
+        return nullptr;
+    }
+    ExitOnErr(TheJIT->addModule(
+                orc::ThreadSafeModule(std::move(TheModule),
+                                      std::move(TheContext))));
+    InitializeModuleAndManagers();
+    return lookupNative(Name);
+}
+
+// like fcmp one against 0.0, which is how codegen tests conditions
+static bool isTrue(double V) { return V < 0.0 || V > 0.0; }
+
+static double run(Bytecode &Code, const double* Args);
+
+static double call(InterpFunction &F, const double* Args) {
+    if (!F.Native && (!F.AST || (++F.Hotness >= HotThreshold &&
+                                 F.NumArgs <= MaxNativeArgs)))
+        F.Native = lookupNative(F.Name);
+    if (F.Native)
+        return callNative(F.Native, F.NumArgs, Args);
+    return run(*F.Code, Args);
+}
+
+/**
+ * @brief Interpret a prepared function
+ */
+static double run(Bytecode &Code, const double* Args) {
+    size_t NumArgs = Code.Source->getProto().getArgs().size();
+    SmallVector<double, 32> Frame(Code.NumSlots + Code.MaxStack);
+    double* Slots = Frame.data();
+    double* SP = Slots + Code.NumSlots;
+    std::copy(Args, Args + NumArgs, Slots);
+    SmallVector<unsigned, 4> Trips(Code.Loops.size());
+
+    for (size_t PC = 0;;) {
+        const Instr &I = Code.Instrs[PC++];
+        switch (I.Op) {
+            case Opcode::Const:
+                *SP++ = Code.Constants[I.Arg];
+                break;
+            case Opcode::Load:
+                *SP++ = Slots[I.Arg];
+                break;
+            case Opcode::Store:
+                Slots[I.Arg] = *--SP;
+                break;
+            case Opcode::Add:
+                --SP;
+                SP[-1] = SP[-1] + SP[0];
+                break;
+            case Opcode::Sub:
+                --SP;
+                SP[-1] = SP[-1] - SP[0];
+                break;
+            case Opcode::Mul:
+                --SP;
+                SP[-1] = SP[-1] * SP[0];
+                break;
+            case Opcode::Div:
+                --SP;
+                SP[-1] = SP[-1] / SP[0];
+                break;
+            case Opcode::Less:
+                // unordered or less than, like fcmp ult
+                --SP;
+                SP[-1] = !(SP[-1] >= SP[0]) ? 1.0 : 0.0;
+                break;
+            case Opcode::Call: {
+                InterpFunction &F = *Code.Callees[I.Arg];
+                SP -= F.NumArgs;
+                *SP = call(F, SP);
+                ++SP;
+                break;
+            }
+            case Opcode::Jump:
+                PC = I.Arg;
+                break;
+            case Opcode::JumpIfFalse:
+                if (!isTrue(*--SP))
+                    PC = I.Arg;
+                break;
+            case Opcode::LoopBack: {
+                if (!isTrue(*--SP))
+                    break;
+                InterpLoop &L = Code.Loops[I.Arg];
+                if (Code.Owner)
+                    ++Code.Owner->Hotness;
+                if (++Trips[I.Arg] < LoopThreshold || L.Failed) {
+                    PC = L.Head;
+                    break;
+                }
+
+                // hot: run the remaining iterations compiled
+                if (!L.Entry)
+                    L.Entry = compileLoopEntry(Code, L);
+                if (!L.Entry) {
+                    PC = L.Head;
+                    break;
+                }
+                SmallVector<double, MaxNativeArgs> LiveVals;
+                for (auto &[Name, Slot] : L.Live)
+                    LiveVals.push_back(Slots[Slot]);
+                callNative(L.Entry, LiveVals.size(), LiveVals.data());
+                break;
+            }
+            case Opcode::Pop:
+                --SP;
+                break;
+            case Opcode::Ret:
+                return SP[-1];
+        }
+    }
+}
+
+std::optional<double> interpretTopLevelExpression(const FunctionAST &FnAST) {
+    Bytecode Code;
+    Code.Source = &FnAST;
+    if (!BytecodeCompiler(Code).compile() || !prepareCallees(Code))
+        return std::nullopt;
+    return run(Code, nullptr);
+}
@@ -0,0 +1,32 @@
+#ifndef my_interp_hpp
+#define my_interp_hpp
+
+#include <memory>
+#include <optional>
+
+#include "ast.hpp"
+
+/**
+ * @brief Make a definition callable from interpreted code. Its bytecode is
+ * generated on its first interpreted call.
+ */
+void addInterpDefinition(std::shared_ptr<FunctionAST> FnAST);
+
+/**
+ * @brief Make an extern callable from interpreted code. It is called through
+ * the address the JIT resolves for it.
+ */
+void addInterpExtern(const PrototypeAST &Proto);
+
+/**
+ * @brief Run a top-level expression in the interpreter tier. Functions it
+ * calls are interpreted until they get hot, after which they are compiled
+ * by the JIT and called natively. Hot loops continue in compiled code.
+ *
+ * @param FnAST Anonymous function wrapping the expression
+ * @return std::optional<double> Result, or nothing if the expression uses
+ * something the interpreter cannot run. Nothing has been run in that case.
+ */
+std::optional<double> interpretTopLevelExpression(const FunctionAST &FnAST);
+
+#endif
@@ -1,71 +1,165 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "lexer.hpp"
 
-std::string IdentifierStr;
+std::unique_ptr<Lexer> TheLexer;
+Symbol IdentifierSym;
 double NumVal;
 
-int gettok() {
-    static int LastChar = ' ';
+// size of each read() when the input is a pipe or terminal
+static constexpr size_t ChunkSize = 1 << 18;
+
+std::unique_ptr<Lexer> Lexer::CreateFromFile(const char* Path) {
+    int FD = open(Path, O_RDONLY);
+    if (FD < 0)
+        return nullptr;
+
+    struct stat St;
+    if (fstat(FD, &St) == 0 && S_ISREG(St.st_mode)) {
+        std::unique_ptr<Lexer> L(new Lexer());
+        if (St.st_size == 0) {
+            close(FD);
+            return L;
+        }
+        void* Addr = mmap(nullptr, St.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+        if (Addr != MAP_FAILED) {
+            close(FD);
+            madvise(Addr, St.st_size, MADV_SEQUENTIAL);
+            L->MapAddr = Addr;
+            L->MapSize = St.st_size;
+            L->BufStart = L->BufCur = static_cast<const char*>(Addr);
+            L->BufEnd = L->BufStart + St.st_size;
+            return L;
+        }
+    }
+
+    // not mappable (fifo, device, ...) -> read it like a pipe
+    auto L = CreateFromStream(FD);
+    L->OwnsFD = true;
+    return L;
+}
+
+std::unique_ptr<Lexer> Lexer::CreateFromStream(int FD) {
+    std::unique_ptr<Lexer> L(new Lexer());
+    L->FD = FD;
+    return L;
+}
+
+Lexer::~Lexer() {
+    if (MapAddr)
+        munmap(MapAddr, MapSize);
+    if (OwnsFD)
+        close(FD);
+}
+
+/**
+ * @brief Read the next chunk of a stream into the buffer. Only the token that
+ * is currently being scanned (if any) is kept from the previous chunk.
+ *
+ * @return bool False once the input is exhausted
+ */
+bool Lexer::refill() {
+    if (FD < 0 || AtEOF)
+        return false;
+
+    const char* Keep = TokStart ? TokStart : BufCur;
+    size_t KeepOff = Keep - BufStart;
+    size_t Kept = BufEnd - Keep;
+    size_t CurOff = BufCur - Keep;
+    BufOffset += KeepOff;
+
+    // resizing may move the storage, so only use offsets from here on
+    if (Storage.size() < Kept + ChunkSize)
+        Storage.resize(Kept + ChunkSize);
+    if (Kept && KeepOff)
+        memmove(Storage.data(), Storage.data() + KeepOff, Kept);
+
+    ssize_t N;
+    do
+        N = read(FD, Storage.data() + Kept, Storage.size() - Kept);
+    while (N < 0 && errno == EINTR);
+
+    BufStart = Storage.data();
+    BufCur = BufStart + CurOff;
+    BufEnd = BufStart + Kept + (N > 0 ? N : 0);
+    if (TokStart)
+        TokStart = BufStart;
 
-    // whitespace
-    while (isspace(LastChar)) 
-        LastChar = getchar();
+    if (N <= 0) {
+        AtEOF = true;
+        return false;
+    }
+    return true;
+}
+
+int Lexer::gettok() {
+    TokStart = nullptr;
+
+    // whitespace and comments
+    while (ensure()) {
+        char C = *BufCur;
+        if (C == '\n') {
+            ++BufCur;
+            ++Line;
+            LineOffset = BufOffset + (BufCur - BufStart);
+        } else if (isspace((unsigned char)C)) {
+            ++BufCur;
+        } else if (C == '#') {
+            while (ensure() && *BufCur != '\n' && *BufCur != '\r')
+                ++BufCur;
+        } else {
+            break;
+        }
+    }
+
+    TokStart = BufCur;
+    TokLoc.Offset = BufOffset + (BufCur - BufStart);
+    TokLoc.Line = Line;
+    TokLoc.Col = TokLoc.Offset - LineOffset + 1;
+
+    if (BufCur == BufEnd)
+        return token_eof;
+
+    unsigned char C = *BufCur++;
 
     // identifier strings
-    if (isalpha(LastChar) || LastChar == '_') {
-        IdentifierStr = LastChar;
-        while ( isalnum(( LastChar = getchar() )) || LastChar == '_' )
-            IdentifierStr += LastChar;
-        
-        if (IdentifierStr == "def")
-            return token_def;
-        if (IdentifierStr == "extern")
-            return token_extern;
-        if (IdentifierStr == "as")
-            return token_as;
-        if (IdentifierStr == "if")
-            return token_if;
-        if (IdentifierStr == "then")
-            return token_then;
-        if (IdentifierStr == "else")
-            return token_else;
-        if (IdentifierStr == "for")
-            return token_for;
-        if (IdentifierStr == "do")
-            return token_do;
-        if (IdentifierStr == "binary")
-            return token_binary;
-        if (IdentifierStr == "unary")
-            return token_unary;
+    if (isalpha(C) || C == '_') {
+        while (ensure() && (isalnum((unsigned char)*BufCur) || *BufCur == '_'))
+            ++BufCur;
+        IdentifierSym = Symbols.intern(
+                llvm::StringRef(TokStart, BufCur - TokStart));
+
+        // keywords are the first symbols, in token order
+        static const int KeywordTokens[] = {
+            token_def, token_extern, token_as, token_if, token_then,
+            token_else, token_for, token_do, token_binary, token_unary,
+            token_parallel, token_var, token_in
+        };
+        if (IdentifierSym <= sym_last_keyword)
+            return KeywordTokens[IdentifierSym];
         return token_identifier;
     }
 
     // numbers --> int and float
-    if (isdigit(LastChar) || LastChar == '.') {
-        std::string NumStr;
-        do{
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
+    if (isdigit(C) || C == '.') {
+        while (ensure() && (isdigit((unsigned char)*BufCur) || *BufCur == '.'))
+            ++BufCur;
 
+        std::string NumStr(TokStart, BufCur);
         NumVal = strtod(NumStr.c_str(), nullptr);
         return token_number;
     }
 
-    // comments
-    if (LastChar == '#') {
-        do
-            LastChar = getchar();
-        while (LastChar != EOF &&
-               LastChar != '\n' && LastChar != '\r');
-        if (LastChar != EOF)
-            return gettok();
-
-    }
-    if (LastChar == EOF)
-        return token_eof;
+    return C;
+}
 
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
+int gettok() {
+    return TheLexer->gettok();
 }
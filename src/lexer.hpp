@@ -1,7 +1,12 @@
 #ifndef my_lexer_hpp
 #define my_lexer_hpp
 
+#include <cstddef>
 #include <memory>
+#include <string>
+#include <vector>
+
+#include "symbol.hpp"
 
 enum Token {
     token_eof        = -1,
@@ -21,10 +26,93 @@ enum Token {
     token_do         = -11,
 
     token_binary     = -12,
-    token_unary      = -13
+    token_unary      = -13,
+
+    token_parallel   = -14,
+
+    token_var        = -15,
+    token_in         = -16
+};
+
+/**
+ * @struct SourceLocation
+ * @brief Position of a token in the source. Line and column are 1-based,
+ * offset is the byte offset from the start of the input.
+ *
+ */
+struct SourceLocation {
+    unsigned Line = 1;
+    unsigned Col = 1;
+    size_t Offset = 0;
+};
+
+/**
+ * @class Lexer
+ * @brief Tokenizer that works over a whole buffer instead of pulling single
+ * characters through stdio. Files are memory-mapped; pipes and terminals are
+ * read in large chunks into a buffer that only keeps the unfinished token.
+ *
+ */
+class Lexer {
+    const char* BufStart = nullptr;
+    const char* BufCur = nullptr;
+    const char* BufEnd = nullptr;
+    const char* TokStart = nullptr;
+
+    // absolute offset of BufStart and of the current line in the input
+    size_t BufOffset = 0;
+    size_t LineOffset = 0;
+    unsigned Line = 1;
+    SourceLocation TokLoc;
+
+    // mapped file, or the descriptor and chunk storage of a stream
+    void* MapAddr = nullptr;
+    size_t MapSize = 0;
+    int FD = -1;
+    bool OwnsFD = false;
+    bool AtEOF = false;
+    std::vector<char> Storage;
+
+    Lexer() = default;
+    bool refill();
+    bool ensure() { return BufCur != BufEnd || refill(); }
+
+public:
+    ~Lexer();
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+
+    /**
+     * @brief Create a lexer over a file. Regular files are mapped into
+     * memory, anything that cannot be mapped is read as a stream.
+     *
+     * @param Path Path of the source file
+     * @return Lexer, or nullptr if the file cannot be opened
+     */
+    static std::unique_ptr<Lexer> CreateFromFile(const char* Path);
+
+    /**
+     * @brief Create a lexer reading from an already open file descriptor
+     *
+     * @param FD File descriptor to read (e.g. 0 for stdin)
+     */
+    static std::unique_ptr<Lexer> CreateFromStream(int FD);
+
+    /**
+     * @brief Read the next token, updating IdentifierSym / NumVal
+     *
+     * @return int Token kind, or the character itself for single-char tokens
+     */
+    int gettok();
+
+    /**
+     * @brief Location of the token most recently returned by gettok()
+     */
+    const SourceLocation &getTokLoc() const { return TokLoc; }
 };
 
-extern std::string IdentifierStr;
+extern std::unique_ptr<Lexer> TheLexer;
+extern Symbol IdentifierSym;
 extern double NumVal;
 
 int gettok();
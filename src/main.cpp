@@ -1,41 +1,181 @@
+#include "aot.hpp"
 #include "driver.hpp"
+#include "object_cache.hpp"
 #include <memory>
+#include <string>
 
 using namespace llvm;
 extern ExitOnError ExitOnErr;
 extern std::unique_ptr<orc::KaleidoscopeJIT> TheJIT;
+extern "C" void __inhu_set_num_threads(int n);
 
-// library functions that can be 'extern'd from user code
+static void PrintUsage(const char* Argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] [script]\n"
+            "  -O0 | -O1 | -O2 | -O3  optimization level (default -O2)\n"
+            "  --whole-program        compile the script as a single module\n"
+            "  --lazy                 compile each function on its first call\n"
+            "  --tiered               interpret code until it is hot, then compile it\n"
+            "  --pgo                  profile code, then recompile hot functions at -O3\n"
+            "  --fast-math            allow floating-point math to be reordered\n"
+            "  -j N                   threads compiling a script (default: all cores)\n"
+            "  --threads N            threads running 'parallel for' loops\n"
+            "                         (default: $INHU_NUM_THREADS, or all cores)\n"
+            "  --cache-dir DIR        keep compiled objects in DIR across runs\n"
+            "  --mcpu CPU             CPU to generate code for, or 'native' (default:\n"
+            "                         native, and generic with -c / --emit-exe)\n"
+            "  --mattr FEATURES       enable/disable CPU features, e.g. +avx2,-fma\n"
+            "  -c                     compile the script to an object file\n"
+            "  --emit-exe             compile the script to an executable\n"
+            "  -o PATH                output of -c / --emit-exe\n",
+            Argv0);
+}
 
+/**
+ * @brief Parse the command line into Options
+ *
+ * @return bool False if the command line is invalid
+ */
+static bool ParseArgs(int argc, char** argv) {
+    bool HasOptLevel = false;
+    for (int i = 1; i < argc; ++i) {
+        StringRef Arg = argv[i];
+        if (Arg == "-O0" || Arg == "-O1" || Arg == "-O2" || Arg == "-O3") {
+            static const OptimizationLevel Levels[] = {
+                OptimizationLevel::O0, OptimizationLevel::O1,
+                OptimizationLevel::O2, OptimizationLevel::O3
+            };
+            Options.OptLevel = Levels[Arg[2] - '0'];
+            HasOptLevel = true;
+        }
+        else if (Arg == "--whole-program")
+            Options.WholeProgram = true;
+        else if (Arg == "--lazy")
+            Options.Lazy = true;
+        else if (Arg == "--tiered")
+            Options.Tiered = true;
+        else if (Arg == "--pgo")
+            Options.ProfileGuided = true;
+        else if (Arg == "--fast-math")
+            Options.FastMath = true;
+        else if (Arg == "--threads" && i + 1 < argc) {
+            if (StringRef(argv[++i]).getAsInteger(10, Options.LoopThreads))
+                return false;
+        }
+        else if (Arg == "--cache-dir" && i + 1 < argc)
+            Options.CacheDir = argv[++i];
+        else if (Arg == "--mcpu" && i + 1 < argc)
+            Options.CPU = argv[++i];
+        else if (Arg == "--mattr" && i + 1 < argc)
+            Options.Features = argv[++i];
+        else if (Arg == "-c")
+            Options.EmitObject = true;
+        else if (Arg == "--emit-exe")
+            Options.EmitExe = true;
+        else if (Arg == "-o" && i + 1 < argc)
+            Options.OutputPath = argv[++i];
+        else if (Arg.consume_front("-j")) {
+            if (Arg.empty() && i + 1 < argc)
+                Arg = argv[++i];
+            if (Arg.getAsInteger(10, Options.Jobs))
+                return false;
+        }
+        else if (Arg.startswith("-") || Options.ScriptPath)
+            return false;
+        else
+            Options.ScriptPath = argv[i];
+    }
+    // compile cost is paid once ahead of time, so default to -O3 there
+    bool AOT = Options.EmitObject || Options.EmitExe;
+    if (AOT && !HasOptLevel)
+        Options.OptLevel = OptimizationLevel::O3;
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
+    // the REPL has to run each item as soon as it is entered
+    if ((Options.WholeProgram || AOT) && !Options.ScriptPath)
+        return false;
 
-extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char)X, stderr);
-    return 0;
+    // those compile everything before any of it runs
+    if (Options.Tiered && (Options.WholeProgram || AOT))
+        return false;
+
+    // the instrumented code is replaced function by function as it runs
+    if (Options.ProfileGuided && (Options.WholeProgram || AOT ||
+                                  Options.Lazy || Options.Tiered))
+        return false;
+    return !(Options.EmitObject && Options.EmitExe);
 }
 
-extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "%f\n", X);
-    return 0;
+/**
+ * @brief Everything besides the IR that determines the generated code, used
+ * to key the object cache
+ */
+static std::string GetTargetID() {
+    // objects built for a named CPU can be shared by every machine that has
+    // it, e.g. through a cache directory on a network drive. For the host,
+    // machines with the same CPU can still have features turned off, e.g.
+    // AVX-512 in a VM, so those are part of the key.
+    std::string CPU = Options.CPU ? Options.CPU : "native";
+    if (CPU == "native") {
+        auto Host = ExitOnErr(orc::JITTargetMachineBuilder::detectHost());
+        CPU = Host.getCPU() + "," + Host.getFeatures().getString();
+    }
+    return sys::getProcessTriple() + "/" + CPU + "/" +
+           (Options.Features ? Options.Features : "") + "/O" +
+           std::to_string(Options.OptLevel.getSpeedupLevel());
 }
 
-int main() {
+int main(int argc, char** argv) {
+    if (!ParseArgs(argc, argv)) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (Options.ScriptPath) {
+        TheLexer = Lexer::CreateFromFile(Options.ScriptPath);
+        if (!TheLexer) {
+            fprintf(stderr, "Error: cannot open '%s'\n", Options.ScriptPath);
+            return 1;
+        }
+    } else {
+        TheLexer = Lexer::CreateFromStream(0);
+    }
+
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
     InitializeNativeTargetAsmParser();
 
-    fprintf(stderr, ">>> ");
+    if (isInteractive())
+        fprintf(stderr, ">>> ");
     getNextToken();
 
-    TheJIT = ExitOnErr(orc::KaleidoscopeJIT::Create());
+    if (Options.EmitObject || Options.EmitExe)
+        return CompileAheadOfTime(argv[0]);
+
+    if (Options.LoopThreads)
+        __inhu_set_num_threads(Options.LoopThreads);
+
+    std::unique_ptr<ObjectFileCache> Cache;
+    if (Options.CacheDir)
+        Cache = std::make_unique<ObjectFileCache>(Options.CacheDir,
+                                                  GetTargetID());
+
+    TheJIT = ExitOnErr(orc::KaleidoscopeJIT::Create(GetCodeGenOptLevel(),
+                                                      Options.Lazy,
+                                                      Options.Jobs != 1,
+                                                      Cache.get(), Options.CPU,
+                                                      Options.Features));
 
     InitializeModuleAndManagers();
+    InitializeLazyOptimizer();
+    InitializeCodegenPool();
+
+    if (Options.WholeProgram)
+        RunWholeProgram();
+    else
+        MainLoop();
+    StopTierUp();
 
-    MainLoop();
+    if (Cache)
+        fprintf(stderr, "Object cache: %u hits, %u misses\n",
+                Cache->getHits(), Cache->getMisses());
     return 0;
 }
@@ -0,0 +1,127 @@
+#include "multiversion.hpp"
+#include "driver.hpp"
+#include <llvm/Transforms/Utils/Cloning.h>
+
+using namespace llvm;
+
+// x86-64 levels, worst first, with the number __inhu_cpu_level() returns
+// for them
+static const struct {
+    const char* CPU;
+    int Level;
+} Versions[] = {{"x86-64-v2", 2}, {"x86-64-v3", 3}, {"x86-64-v4", 4}};
+
+/**
+ * @brief The x86-64 level the code is built for, or 0 if it is built for a
+ * particular CPU. JIT-compiled code is built for the host unless --mcpu
+ * names a CPU, code compiled ahead of time for --mcpu, generic by default.
+ * A named CPU may have more than the levels' features, or others, so there
+ * is no telling which of the levels is better than it.
+ */
+static int getBaselineLevel() {
+    bool AOT = Options.EmitObject || Options.EmitExe;
+    StringRef CPU = Options.CPU ? Options.CPU : AOT ? "generic" : "native";
+    if (CPU == "generic" || CPU == "x86-64")
+        return 1;
+    for (const auto &V : Versions)
+        if (CPU == V.CPU)
+            return V.Level;
+    return 0;
+}
+
+/**
+ * @brief Internal copy of F named F.Suffix. Calls of F in the body become
+ * direct calls of the copy.
+ */
+static Function* cloneFunction(Function &F, const Twine &Suffix) {
+    Function* Clone = Function::Create(F.getFunctionType(),
+                                       GlobalValue::InternalLinkage,
+                                       F.getName() + "." + Suffix,
+                                       F.getParent());
+    ValueToValueMapTy VMap;
+    auto CloneArg = Clone->arg_begin();
+    for (Argument &Arg : F.args())
+        VMap[&Arg] = &*CloneArg++;
+    VMap[&F] = Clone;
+
+    SmallVector<ReturnInst*, 4> Returns;
+    CloneFunctionInto(Clone, &F, VMap,
+                      CloneFunctionChangeType::LocalChangesOnly, Returns);
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    return Clone;
+}
+
+void addCPUVersions(Function &F) {
+    int Baseline = getBaselineLevel();
+    if (!Baseline || Baseline == Versions[std::size(Versions) - 1].Level ||
+        GetTargetMachine().getTargetTriple().getArch() != Triple::x86_64)
+        return;
+
+    // the body as it is runs on every CPU of the baseline level. The levels
+    // above it get the features of --mattr on top of their own; without
+    // --mattr they keep the features the body was generated with.
+    Function* Base = cloneFunction(F, "base");
+    SmallVector<Function*, 4> Clones;
+    SmallVector<int, 4> Levels;
+    for (const auto &V : Versions) {
+        if (V.Level <= Baseline)
+            continue;
+        Function* Clone = cloneFunction(F, V.CPU);
+        Clone->addFnAttr("target-cpu", V.CPU);
+        if (Options.Features)
+            Clone->addFnAttr("target-features", Options.Features);
+        Clones.push_back(Clone);
+        Levels.push_back(V.Level);
+    }
+
+    GlobalValue::LinkageTypes Linkage = F.getLinkage();
+    F.deleteBody();
+    F.setLinkage(Linkage);
+
+    PointerType* PtrTy = Builder->getPtrTy();
+    auto* Impl = new GlobalVariable(*F.getParent(), PtrTy, false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantPointerNull::get(PtrTy),
+                                    F.getName() + ".impl");
+
+    BasicBlock* EntryBB = BasicBlock::Create(*TheContext, "entry", &F);
+    BasicBlock* ResolveBB = BasicBlock::Create(*TheContext, "resolve", &F);
+    BasicBlock* CallBB = BasicBlock::Create(*TheContext, "call", &F);
+
+    // pairs with the release store of the version picked
+    Builder->SetInsertPoint(EntryBB);
+    LoadInst* Known = Builder->CreateAlignedLoad(PtrTy, Impl, Align(8),
+                                                 "impl");
+    Known->setAtomic(AtomicOrdering::Acquire);
+    Builder->CreateCondBr(Builder->CreateIsNotNull(Known), CallBB, ResolveBB);
+
+    // the first call picks the best version the CPU can run. Calls racing
+    // with it pick the same one.
+    Builder->SetInsertPoint(ResolveBB);
+    FunctionCallee CPULevel = F.getParent()->getOrInsertFunction(
+            "__inhu_cpu_level", Builder->getInt32Ty());
+    Value* Level = Builder->CreateCall(CPULevel, {}, "level");
+    Value* Best = Base;
+    for (unsigned i = 0; i < Clones.size(); ++i)
+        Best = Builder->CreateSelect(
+                Builder->CreateICmpSGE(Level, Builder->getInt32(Levels[i])),
+                Clones[i], Best);
+    StoreInst* Store = Builder->CreateAlignedStore(Best, Impl, Align(8));
+    Store->setAtomic(AtomicOrdering::Release);
+    Builder->CreateBr(CallBB);
+
+    Builder->SetInsertPoint(CallBB);
+    PHINode* Fn = Builder->CreatePHI(PtrTy, 2, "fn");
+    Fn->addIncoming(Known, EntryBB);
+    Fn->addIncoming(Best, ResolveBB);
+    SmallVector<Value*, 8> Args;
+    for (auto &Arg : F.args())
+        Args.push_back(&Arg);
+    CallInst* Call = Builder->CreateCall(F.getFunctionType(), Fn, Args);
+    Call->setTailCall();
+    Builder->CreateRet(Call);
+
+    // inlined into callers, the dispatcher would bring every version along
+    F.addFnAttr(Attribute::NoInline);
+    verifyFunction(F);
+}
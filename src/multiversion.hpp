@@ -0,0 +1,19 @@
+#ifndef my_multiversion_hpp
+#define my_multiversion_hpp
+
+#include "ast.hpp"
+
+/**
+ * @brief Compile a generated definition once more for each x86-64 level
+ * (x86-64-v2 to v4) above the one the code is built for, and turn it into a
+ * dispatcher: its first call asks the runtime which level the CPU supports
+ * and the calls go to the best version from then on. Does nothing unless
+ * the code is built for x86-64 at a level rather than for the host or a
+ * named CPU, i.e. ahead of time or with --mcpu generic, x86-64 or
+ * x86-64-v2 or -v3.
+ *
+ * @param F Function with its generated body, generic or a specialized clone
+ */
+void addCPUVersions(llvm::Function &F);
+
+#endif
@@ -0,0 +1,112 @@
+#include "object_cache.hpp"
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+
+using namespace llvm;
+
+ObjectFileCache::ObjectFileCache(std::string Dir, std::string TargetID)
+    : Dir(std::move(Dir)), TargetID(std::move(TargetID)) {
+    if (auto EC = sys::fs::create_directories(this->Dir))
+        fprintf(stderr, "Error: cannot create cache directory '%s': %s\n",
+                this->Dir.c_str(), EC.message().c_str());
+}
+
+/**
+ * @brief Path of the cache file for a module: the MD5 of its bitcode and
+ * the target description
+ */
+std::string ObjectFileCache::getCachePath(const Module &M) const {
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+
+    MD5 Hash;
+    Hash.update(TargetID);
+    Hash.update(StringRef(Bitcode.data(), Bitcode.size()));
+    MD5::MD5Result Result;
+    Hash.final(Result);
+
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, Twine(Result.digest()) + ".o");
+    return std::string(Path);
+}
+
+/**
+ * @brief Whether a constant is, or is computed from, an address of this
+ * process turned into a pointer
+ */
+static bool isHostAddress(const Constant* C) {
+    auto* CE = dyn_cast<ConstantExpr>(C);
+    if (!CE)
+        return false;
+    if (CE->getOpcode() == Instruction::IntToPtr)
+        return true;
+    return any_of(CE->operands(), [](const Use &Op) {
+        return isHostAddress(cast<Constant>(Op));
+    });
+}
+
+/**
+ * @brief Whether code refers to objects of this process by address, as
+ * profiled code does to its counters. Its object is only good for this run,
+ * and the addresses make every run's bitcode different.
+ */
+static bool refersToHostAddresses(const Module &M) {
+    for (const Function &F : M)
+        for (const BasicBlock &BB : F)
+            for (const Instruction &I : BB)
+                for (const Value* Op : I.operands())
+                    if (auto* C = dyn_cast<Constant>(Op))
+                        if (isHostAddress(C))
+                            return true;
+    return false;
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::getObject(const Module* M) {
+    // neither looked up nor written, so not a miss either
+    if (refersToHostAddresses(*M))
+        return nullptr;
+
+    std::string Path = getCachePath(*M);
+    if (auto Obj = MemoryBuffer::getFile(Path)) {
+        ++Hits;
+        return std::move(*Obj);
+    }
+
+    ++Misses;
+    std::lock_guard<std::mutex> Guard(PendingMutex);
+    Pending[M] = std::move(Path);
+    return nullptr;
+}
+
+void ObjectFileCache::notifyObjectCompiled(const Module* M,
+                                           MemoryBufferRef Obj) {
+    std::string Path;
+    {
+        std::lock_guard<std::mutex> Guard(PendingMutex);
+        auto It = Pending.find(M);
+        if (It == Pending.end())
+            return;
+        Path = std::move(It->second);
+        Pending.erase(It);
+    }
+
+    // write to a temporary file first, so that other processes sharing the
+    // cache never see a partial object
+    int FD;
+    SmallString<128> TmpPath;
+    if (sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, TmpPath))
+        return;
+    {
+        raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << Obj.getBuffer();
+        if (OS.has_error()) {
+            OS.clear_error();
+            sys::fs::remove(TmpPath);
+            return;
+        }
+    }
+    if (sys::fs::rename(TmpPath, Path))
+        sys::fs::remove(TmpPath);
+}
@@ -0,0 +1,52 @@
+#ifndef my_object_cache_hpp
+#define my_object_cache_hpp
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "llvm_headers.hpp"
+
+/**
+ * @class ObjectFileCache
+ * @brief On-disk cache of the object files the JIT compiles. Entries are
+ * keyed by a hash of the module's optimized IR together with a description
+ * of the target, so a rerun of an unchanged script loads its objects from
+ * disk and skips the backend. Modules that refer to objects of the process
+ * by address, such as the counters of profiled code, are not cached.
+ *
+ */
+class ObjectFileCache : public llvm::ObjectCache {
+    std::string Dir;
+    std::string TargetID;
+
+    // cache file of each module between getObject() and
+    // notifyObjectCompiled(); modules are compiled concurrently
+    std::mutex PendingMutex;
+    llvm::DenseMap<const llvm::Module*, std::string> Pending;
+
+    std::atomic<unsigned> Hits{0};
+    std::atomic<unsigned> Misses{0};
+
+    std::string getCachePath(const llvm::Module &M) const;
+
+public:
+    /**
+     * @brief Create a cache in a directory, creating it if needed
+     *
+     * @param Dir Cache directory
+     * @param TargetID Target triple, CPU and anything else that changes the
+     * generated code for the same IR
+     */
+    ObjectFileCache(std::string Dir, std::string TargetID);
+
+    void notifyObjectCompiled(const llvm::Module* M,
+                              llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer>
+    getObject(const llvm::Module* M) override;
+
+    unsigned getHits() const { return Hits; }
+    unsigned getMisses() const { return Misses; }
+};
+
+#endif
@@ -17,6 +17,13 @@ using namespace llvm;
 int CurTok;
 extern double NumVal;
 
+/*
+ * CurPool - pool receiving the nodes of the top-level item being parsed.
+ * ParseDefinition() and ParseTopLevelExpr() start a fresh one and hand it to
+ * the resulting FunctionAST.
+ */
+static ExprPool* CurPool;
+
 
 int getNextToken() {
     return CurTok = gettok();
@@ -48,19 +55,19 @@ static int GetTokenPrecedence() {
     return TokenPrec;
 }
 
-std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+ExprRef ParseNumberExpr() {
+    auto Result = CurPool->addNumber(NumVal);
     getNextToken();
-    return std::move(Result);
+    return Result;
 }
 
-std::unique_ptr<ExprAST> ParseParenExpr() {
+ExprRef ParseParenExpr() {
     getNextToken(); // eat left paren
 
     // recursive : ParseExpression calls ParseParenExpr
     auto V = ParseExpression(); 
     if (!V) 
-        return nullptr;
+        return NoExpr;
 
     if (CurTok != ')')
         return LogError("Expected ')'");
@@ -68,24 +75,55 @@ std::unique_ptr<ExprAST> ParseParenExpr() {
     return V;
 }
 
-std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+ExprRef ParseIdentifierExpr() {
+    Symbol IdName = IdentifierSym;
 
     getNextToken(); // eat identifier
 
+    // element of an array, or an assignment to one
+    if (CurTok == '[') {
+        ExprRef Array = CurPool->addVariable(IdName);
+        getNextToken(); // eat [
+        auto Index = ParseExpression();
+        if (!Index)
+            return NoExpr;
+        if (CurTok != ']')
+            return LogError("Expected ']'");
+        getNextToken(); // eat ]
+
+        if (CurTok != '=')
+            return CurPool->addIndex(Array, Index);
+        getNextToken(); // eat =
+        auto Value = ParseExpression();
+        if (!Value)
+            return NoExpr;
+        return CurPool->addStore(Array, Index, Value);
+    }
+
+    // assignment to a variable
+    if (CurTok == '=') {
+        getNextToken(); // eat =
+        auto Value = ParseExpression();
+        if (!Value)
+            return NoExpr;
+        return CurPool->addAssign(IdName, Value);
+    }
+
     // if it's a variable call
     if (CurTok != '(')
-        return std::make_unique<VariableExprAST>(IdName);
+        return CurPool->addVariable(IdName);
 
     // dealing with function calls
     getNextToken();
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    SmallVector<ExprRef, 8> Args;
     if (CurTok != ')') {
         while (true) {
             if (auto Arg = ParseExpression()) 
-                Args.push_back(std::move(Arg));
+                Args.push_back(Arg);
             else
-                return nullptr;
+                return NoExpr;
+            if (Args.size() > ExprPool::MaxOperands)
+                return LogError("Too many arguments in call");
 
             // end args list
             if (CurTok == ')')
@@ -98,10 +136,10 @@ std::unique_ptr<ExprAST> ParseIdentifierExpr() {
         }
     }
     getNextToken(); // eat )
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return CurPool->addCall(IdName, Args);
 }
 
-std::unique_ptr<ExprAST> ParsePrimary() {
+ExprRef ParsePrimary() {
     switch (CurTok) {
         default:
             return LogError("Unknown token when expecting an expression.");
@@ -115,11 +153,14 @@ std::unique_ptr<ExprAST> ParsePrimary() {
             return ParseIfExpr();
         case token_for:
             return ParseForExpr();
+        case token_parallel:
+            return ParseParallelForExpr();
+        case token_var:
+            return ParseVarExpr();
     }
 }
 
-std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                       std::unique_ptr<ExprAST> LHS) {
+ExprRef ParseBinOpRHS(int ExprPrec, ExprRef LHS) {
     while (true) {
         int TokenPrec = GetTokenPrecedence();
 
@@ -133,25 +174,23 @@ std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
         getNextToken();
         auto RHS = ParseUnary(); // parse unary oper after binop
         if (!RHS)
-            return nullptr;
+            return NoExpr;
 
         // If BinOp binds less tightly with RHS than the operator after RHS, let
         // the pending operator take RHS as its LHS.
         int NextTokenPrec = GetTokenPrecedence();
         if (TokenPrec < NextTokenPrec) {
-            RHS = ParseBinOpRHS(TokenPrec+1, std::move(RHS));
+            RHS = ParseBinOpRHS(TokenPrec+1, RHS);
             if (!RHS)
-                return nullptr;
+                return NoExpr;
         }
 
         // merge LHS, RHS
-        LHS = std::make_unique<BinaryExprAST>(BinOp,
-                                              std::move(LHS),
-                                              std::move(RHS));
+        LHS = CurPool->addBinary(BinOp, LHS, RHS);
     }
 }
 
-std::unique_ptr<ExprAST> ParseUnary() {
+ExprRef ParseUnary() {
     // if current token is not an oper, then it is a primary expr
     if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
         return ParsePrimary();
@@ -160,12 +199,12 @@ std::unique_ptr<ExprAST> ParseUnary() {
     int OpChar = CurTok;
     getNextToken();
     if (auto Operand = ParseUnary())
-        return std::make_unique<UnaryExprAST>(OpChar, std::move(Operand));
-    return nullptr;
+        return CurPool->addUnary(OpChar, Operand);
+    return NoExpr;
 }
 
 std::unique_ptr<PrototypeAST> ParsePrototype(bool isExtern) {
-    std::string FnName;
+    Symbol FnName;
 
     unsigned Kind = 0; // 0 -> identifier, 1 -> unary, 2 -> binary
     unsigned BinaryPrecedence = 30;
@@ -174,7 +213,7 @@ std::unique_ptr<PrototypeAST> ParsePrototype(bool isExtern) {
         default:
             return LogErrorP("Expected function name in prototype");
         case token_identifier:
-            FnName = IdentifierStr;
+            FnName = IdentifierSym;
             Kind = 0;
             getNextToken();
             break;
@@ -191,8 +230,7 @@ std::unique_ptr<PrototypeAST> ParsePrototype(bool isExtern) {
             getNextToken();
             if (CurTok != '}')
                 return LogErrorP("Expected closing '}' for unary definitions");
-            FnName = "unary";
-            FnName += (char)UnaryToken;
+            FnName = Symbols.opSymbol(false, (char)UnaryToken);
             Kind = 1;
             getNextToken();
             break;
@@ -218,8 +256,7 @@ std::unique_ptr<PrototypeAST> ParsePrototype(bool isExtern) {
             }
             if (CurTok != '}')
                 return LogErrorP("Expected closing '}' for binary definitions");
-            FnName = "binary";
-            FnName += (char)BinaryToken;
+            FnName = Symbols.opSymbol(true, (char)BinaryToken);
             Kind = 2;
             getNextToken();
 
@@ -230,14 +267,14 @@ std::unique_ptr<PrototypeAST> ParsePrototype(bool isExtern) {
         return LogErrorP("Expected '(' in prototype");
 
     // read argsname list
-    std::vector<std::string> ArgNames;
+    std::vector<Symbol> ArgNames;
     /* while (getNextToken() == token_identifier) {
-        ArgNames.push_back(IdentifierStr);
+        ArgNames.push_back(IdentifierSym);
     } */
     if (CurTok != ')') {
         do {
             getNextToken();
-            ArgNames.push_back(IdentifierStr);
+            ArgNames.push_back(IdentifierSym);
         } while (getNextToken() == ',');
     }
 
@@ -247,6 +284,14 @@ std::unique_ptr<PrototypeAST> ParsePrototype(bool isExtern) {
     // success
     getNextToken(); // eat ')'
 
+    // optional 'fast' and 'versioned' annotations of a definition
+    bool FastMath = false, Versioned = false;
+    while (!isExtern && CurTok == token_identifier &&
+           (IdentifierSym == sym_fast || IdentifierSym == sym_versioned)) {
+        (IdentifierSym == sym_fast ? FastMath : Versioned) = true;
+        getNextToken();
+    }
+
     if (!isExtern) {
         if (CurTok != token_as) {
             return LogErrorP("Expected 'as' after prototype");
@@ -259,7 +304,8 @@ std::unique_ptr<PrototypeAST> ParsePrototype(bool isExtern) {
         return LogErrorP("Invalid number of operands for operator");
 
     return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames),
-                                          Kind != 0, BinaryPrecedence);
+                                          Kind != 0, BinaryPrecedence,
+                                          FastMath, Versioned);
 }
 
 std::unique_ptr<FunctionAST> ParseDefinition() {
@@ -268,16 +314,27 @@ std::unique_ptr<FunctionAST> ParseDefinition() {
     if (!Proto)
         return nullptr;
 
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    auto Pool = std::make_unique<ExprPool>();
+    CurPool = Pool.get();
+    if (auto E = ParseExpression()) {
+        Pool->finish();
+
+        // register the precedence right away, so items parsed after this one
+        // can use the operator even before it is compiled
+        if (Proto->isBinaryOp())
+            BinOpPrec[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
+
+        return std::make_unique<FunctionAST>(std::move(Proto),
+                                             std::move(Pool), E);
+    }
     return nullptr;
 }
 
-std::unique_ptr<ExprAST> ParseIfExpr() {
+ExprRef ParseIfExpr() {
     getNextToken();
     auto Cond = ParseExpression();
     if (!Cond)
-        return nullptr;
+        return NoExpr;
 
     if (CurTok != token_then)
         return LogError("Expected 'then'");
@@ -285,7 +342,7 @@ std::unique_ptr<ExprAST> ParseIfExpr() {
 
     auto Then = ParseExpression();
     if (!Then)
-        return nullptr;
+        return NoExpr;
 
     if (CurTok != token_else)
         return LogError("Expected 'else'");
@@ -293,18 +350,17 @@ std::unique_ptr<ExprAST> ParseIfExpr() {
     getNextToken();
     auto Else = ParseExpression();
     if (!Else)
-        return nullptr;
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                       std::move(Else));
+        return NoExpr;
+    return CurPool->addIf(Cond, Then, Else);
 }
 
-std::unique_ptr<ExprAST> ParseForExpr() {
+ExprRef ParseForExpr(bool Parallel) {
     getNextToken(); // eat for
     
     if (CurTok != token_identifier)
         return LogError("Expected identifier after 'for'");
 
-    std::string IdName = IdentifierStr;
+    Symbol IdName = IdentifierSym;
     getNextToken(); // get identifier
     
     if (CurTok != '=')
@@ -313,22 +369,22 @@ std::unique_ptr<ExprAST> ParseForExpr() {
 
     auto Start = ParseExpression();
     if (!Start)
-        return nullptr;
+        return NoExpr;
     if (CurTok != ',')
         return LogError("Expected ',' after 'for' loop variable");
     getNextToken();
 
     auto End = ParseExpression();
     if (!End)
-        return nullptr;
+        return NoExpr;
 
     // optional step value
-    std::unique_ptr<ExprAST> Step;
+    ExprRef Step = NoExpr;
     if (CurTok == ',') {
         getNextToken();
         Step = ParseExpression();
         if (!Step)
-            return nullptr;
+            return NoExpr;
     }
 
     if (CurTok != token_do)
@@ -337,11 +393,63 @@ std::unique_ptr<ExprAST> ParseForExpr() {
 
     auto Body = ParseExpression();
     if (!Body)
-        return nullptr;
+        return NoExpr;
 
-    return std::make_unique<ForExprAST>(IdName, std::move(Start),
-                                        std::move(End), std::move(Step),
-                                        std::move(Body));
+    if (Parallel)
+        return CurPool->addParallelFor(IdName, Start, End, Step, Body);
+    return CurPool->addFor(IdName, Start, End, Step, Body);
+}
+
+ExprRef ParseParallelForExpr() {
+    getNextToken(); // eat parallel
+    if (CurTok != token_for)
+        return LogError("Expected 'for' after 'parallel'");
+    return ParseForExpr(true);
+}
+
+ExprRef ParseVarExpr() {
+    getNextToken(); // eat var
+
+    if (CurTok != token_identifier)
+        return LogError("Expected identifier after 'var'");
+
+    // each variable is in scope in the initializers after its own
+    SmallVector<std::pair<Symbol, ExprRef>, 4> Vars;
+    while (true) {
+        Symbol Name = IdentifierSym;
+        getNextToken(); // eat identifier
+
+        // optional initializer, 0.0 by default
+        ExprRef Init;
+        if (CurTok == '=') {
+            getNextToken();
+            Init = ParseExpression();
+            if (!Init)
+                return NoExpr;
+        } else {
+            Init = CurPool->addNumber(0.0);
+        }
+        Vars.emplace_back(Name, Init);
+
+        if (CurTok != ',')
+            break;
+        getNextToken();
+        if (CurTok != token_identifier)
+            return LogError("Expected identifier list after 'var'");
+    }
+
+    if (CurTok != token_in)
+        return LogError("Expected 'in' after 'var'");
+    getNextToken();
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return NoExpr;
+
+    // one node per variable, the first one outermost
+    for (auto It = Vars.rbegin(); It != Vars.rend(); ++It)
+        Body = CurPool->addVar(It->first, It->second, Body);
+    return Body;
 }
 
 std::unique_ptr<PrototypeAST> ParseExtern() {
@@ -349,20 +457,23 @@ std::unique_ptr<PrototypeAST> ParseExtern() {
     return ParsePrototype(true);
 }
 
-std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+std::unique_ptr<FunctionAST> ParseTopLevelExpr(Symbol Name) {
+    auto Pool = std::make_unique<ExprPool>();
+    CurPool = Pool.get();
     if (auto E = ParseExpression()) {
+        Pool->finish();
         // make anonymous Proto
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                                                    std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        auto Proto = std::make_unique<PrototypeAST>(Name,
+                                                    std::vector<Symbol>());
+        return std::make_unique<FunctionAST>(std::move(Proto),
+                                             std::move(Pool), E);
     }
     return nullptr;
 }
 
-std::unique_ptr<ExprAST> ParseExpression() {
+ExprRef ParseExpression() {
     auto LHS = ParseUnary();
     if (!LHS)
-        return nullptr;
-    return ParseBinOpRHS(0, std::move(LHS));
+        return NoExpr;
+    return ParseBinOpRHS(0, LHS);
 }
-
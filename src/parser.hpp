@@ -8,38 +8,38 @@
 
 extern int CurTok;
 extern std::map<char, int> BinOpPrec;
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 
 int getNextToken();
 /**
  * @brief Function to be called for 'token_number' type tokens. Takes the 
- * current number value, creates a NumberExprAST node, and moves the lexer
+ * current number value, creates a Number node, and moves the lexer
  * to the next token.
  *
- * @return NumExprAST Node of the new result
+ * @return ExprRef Number node of the new result
  */
-std::unique_ptr<ExprAST> ParseNumberExpr();
+ExprRef ParseNumberExpr();
 
 /**
  * @brief Function to deal with parenthetical expressions
  *
- * @return ExprAST node from parsing the expression inside the parenthesis
+ * @return ExprRef node from parsing the expression inside the parenthesis
  */
-std::unique_ptr<ExprAST> ParseParenExpr();
+ExprRef ParseParenExpr();
 
 /**
  * @brief Function to parse an identifier expression. Deals with either a 
- * named variable or a function call
+ * named variable, an assignment to it or a function call
  *
- * @return ExprAST. VariableExprAST for variable, CallExprAST for func call
+ * @return ExprRef. Variable node for variable, Assign node for assignment,
+ * Call node for func call
  */
-std::unique_ptr<ExprAST> ParseIdentifierExpr();
+ExprRef ParseIdentifierExpr();
 
 /**
  * @brief Function to parse primary expressions, and run a valid parse 
  * function depending on the current token.
  */
-std::unique_ptr<ExprAST> ParsePrimary();
+ExprRef ParsePrimary();
 
 /**
  * @brief Function to parse binary expressions
@@ -47,15 +47,14 @@ std::unique_ptr<ExprAST> ParsePrimary();
  * @param ExprPrec Binary operator precedence
  * @param LHS LHS of the binary operation
  */
-std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                       std::unique_ptr<ExprAST> LHS);
+ExprRef ParseBinOpRHS(int ExprPrec, ExprRef LHS);
 
 /**
  * @brief Function to parse unary expressions
  *
- * @return ExprAST Node
+ * @return ExprRef Node
  */
-std::unique_ptr<ExprAST> ParseUnary();
+ExprRef ParseUnary();
 
 /**
  * @brief Function to parse function prototype
@@ -81,9 +80,10 @@ std::unique_ptr<PrototypeAST> ParseExtern();
 /**
  * @brief Function to parse arbitrary top-level functions
  *
+ * @param Name Name of the anonymous function wrapping the expression
  * @return FunctionAST Node
  */
-std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+std::unique_ptr<FunctionAST> ParseTopLevelExpr(Symbol Name = sym_anon_expr);
 
 /**
  * @brief Function to parse an expression. An expression is a primary
@@ -91,16 +91,28 @@ std::unique_ptr<FunctionAST> ParseTopLevelExpr();
  *
  * @return 
  */
-std::unique_ptr<ExprAST> ParseExpression();
+ExprRef ParseExpression();
 
 /**
  * @brief Function to parse an 'if', 'then', 'else' expression
  */
-std::unique_ptr<ExprAST> ParseIfExpr();
+ExprRef ParseIfExpr();
 
 /**
  * @brief Function to parse 'for' expressions
+ *
+ * @param Parallel Whether it is the loop of a 'parallel for'
+ */
+ExprRef ParseForExpr(bool Parallel = false);
+
+/**
+ * @brief Function to parse 'parallel for' expressions
+ */
+ExprRef ParseParallelForExpr();
+
+/**
+ * @brief Function to parse 'var' expressions declaring local variables
  */
-std::unique_ptr<ExprAST> ParseForExpr();
+ExprRef ParseVarExpr();
 
 #endif
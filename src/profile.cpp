@@ -0,0 +1,237 @@
+#include "profile.hpp"
+#include "driver.hpp"
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+using namespace llvm;
+
+// calls after which a function is recompiled
+static constexpr uint64_t CallThreshold = 10000;
+
+// iterations of a loop, over all calls, after which its function is
+// recompiled
+static constexpr uint64_t LoopThreshold = 100000;
+
+// weights are 32 bits wide, so larger counts are scaled down
+static constexpr uint64_t MaxWeight = UINT32_MAX;
+
+// JIT'd code updates the counters through plain loads and stores of these
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) &&
+              std::atomic<uint64_t>::is_always_lock_free);
+static_assert(sizeof(std::atomic<void*>) == sizeof(void*) &&
+              std::atomic<void*>::is_always_lock_free);
+
+// profiles of all instrumented definitions, by name
+static DenseMap<Symbol, std::unique_ptr<FunctionProfile>> Profiles;
+static std::mutex ProfilesMutex;
+
+// profile used by codegen on this thread, if any
+static thread_local FunctionProfile* CurProfile;
+static thread_local ProfileMode CurMode;
+
+ProfileCodegen::ProfileCodegen(FunctionProfile* Profile, ProfileMode Mode) {
+    CurProfile = Profile;
+    CurMode = Mode;
+}
+
+ProfileCodegen::~ProfileCodegen() { CurProfile = nullptr; }
+
+/**
+ * @brief Give every 'if' and 'for' under E its pair of counters
+ */
+static void layOutCounters(const ExprPool &Pool, ExprRef E,
+                           FunctionProfile &P) {
+    if (Pool.kind(E) == ExprKind::If || Pool.kind(E) == ExprKind::For) {
+        P.Branches[E] = P.NumCounts;
+        P.NumCounts += 2;
+    }
+    for (ExprRef Op : Pool.operands(E)) {
+        // an omitted 'for' step
+        if (Op != NoExpr)
+            layOutCounters(Pool, Op, P);
+    }
+}
+
+void addProfiledDefinition(std::shared_ptr<FunctionAST> FnAST) {
+    Symbol Name = FnAST->getProto().getName();
+    std::lock_guard<std::mutex> Guard(ProfilesMutex);
+    // the JIT does not take a redefinition either
+    auto &P = Profiles[Name];
+    if (P)
+        return;
+
+    P = std::make_unique<FunctionProfile>();
+    P->NumCounts = 1;
+    layOutCounters(FnAST->getPool(), FnAST->getBody(), *P);
+    P->Counts = std::make_unique<std::atomic<uint64_t>[]>(P->NumCounts);
+    P->AST = std::move(FnAST);
+}
+
+FunctionProfile* getProfile(Symbol Name) {
+    std::lock_guard<std::mutex> Guard(ProfilesMutex);
+    auto It = Profiles.find(Name);
+    return It == Profiles.end() ? nullptr : It->second.get();
+}
+
+/**
+ * @brief Called by instrumented code when a counter reaches its threshold
+ */
+static void requestTierUp(FunctionProfile* P) {
+    if (!P->Queued.exchange(true))
+        TierUp(*P);
+}
+
+/**
+ * @brief A host address as a constant pointer in the IR
+ */
+static Constant* addressOf(const void* Ptr) {
+    return ConstantExpr::getIntToPtr(
+            Builder->getInt64(reinterpret_cast<uint64_t>(Ptr)),
+            Builder->getPtrTy());
+}
+
+/**
+ * @brief Branch weights for two edges taken A and B times
+ */
+static MDNode* branchWeights(uint64_t A, uint64_t B) {
+    uint64_t Scale = std::max(A, B) / MaxWeight + 1;
+    return MDBuilder(*TheContext).createBranchWeights(A / Scale, B / Scale);
+}
+
+/**
+ * @brief Increment a counter. Requests a tier-up when it reaches HotAt,
+ * unless that is 0.
+ */
+static void emitCount(unsigned Idx, uint64_t HotAt) {
+    // relaxed atomics are plain moves, but keep the host's reads well-defined
+    Value* Addr = addressOf(&CurProfile->Counts[Idx]);
+    LoadInst* Old = Builder->CreateAlignedLoad(Builder->getInt64Ty(), Addr,
+                                               Align(8), "count");
+    Old->setAtomic(AtomicOrdering::Monotonic);
+    Value* New = Builder->CreateAdd(Old, Builder->getInt64(1), "count");
+    Builder->CreateAlignedStore(New, Addr, Align(8))
+            ->setAtomic(AtomicOrdering::Monotonic);
+    if (!HotAt)
+        return;
+
+    Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock* HotBB = BasicBlock::Create(*TheContext, "tierup", TheFunction);
+    BasicBlock* ContBB = BasicBlock::Create(*TheContext, "counted",
+                                            TheFunction);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(New, Builder->getInt64(HotAt)),
+                          HotBB, ContBB, branchWeights(1, HotAt));
+
+    Builder->SetInsertPoint(HotBB);
+    FunctionType* FTy = FunctionType::get(Builder->getVoidTy(),
+                                          {Builder->getPtrTy()}, false);
+    Builder->CreateCall(FTy,
+                        addressOf(reinterpret_cast<void*>(&requestTierUp)),
+                        {addressOf(CurProfile)});
+    Builder->CreateBr(ContBB);
+    Builder->SetInsertPoint(ContBB);
+}
+
+void profileFunctionEntry(Function* F) {
+    if (!CurProfile)
+        return;
+    if (CurMode == ProfileMode::Apply) {
+        F->setEntryCount(CurProfile->Counts[0].load(std::memory_order_relaxed));
+        return;
+    }
+
+    // pairs with the release store of the recompiled code's address
+    LoadInst* Hot = Builder->CreateAlignedLoad(
+            Builder->getPtrTy(), addressOf(&CurProfile->Optimized), Align(8),
+            "hot");
+    Hot->setAtomic(AtomicOrdering::Acquire);
+    BasicBlock* HotBB = BasicBlock::Create(*TheContext, "tohot", F);
+    BasicBlock* ProfiledBB = BasicBlock::Create(*TheContext, "profiled", F);
+    Builder->CreateCondBr(Builder->CreateIsNotNull(Hot), HotBB, ProfiledBB);
+
+    Builder->SetInsertPoint(HotBB);
+    SmallVector<Value*, 8> Args;
+    for (auto &Arg : F->args())
+        Args.push_back(&Arg);
+    CallInst* Call = Builder->CreateCall(F->getFunctionType(), Hot, Args);
+    Call->setTailCall();
+    Builder->CreateRet(Call);
+
+    Builder->SetInsertPoint(ProfiledBB);
+    emitCount(0, CallThreshold);
+}
+
+void profileEdge(ExprRef E, unsigned Edge) {
+    if (!CurProfile || CurMode != ProfileMode::Instrument)
+        return;
+    auto It = CurProfile->Branches.find(E);
+    if (It == CurProfile->Branches.end())
+        return;
+
+    // a loop that runs long enough makes its function hot
+    bool LoopHeader = Edge == 0 &&
+            CurProfile->AST->getPool().kind(E) == ExprKind::For;
+    emitCount(It->second + Edge, LoopHeader ? LoopThreshold : 0);
+}
+
+void profileBranch(BranchInst* Br, ExprRef E) {
+    if (!CurProfile || CurMode != ProfileMode::Apply)
+        return;
+    auto It = CurProfile->Branches.find(E);
+    if (It == CurProfile->Branches.end())
+        return;
+
+    uint64_t First = CurProfile->Counts[It->second].load(
+            std::memory_order_relaxed);
+    uint64_t Second = CurProfile->Counts[It->second + 1].load(
+            std::memory_order_relaxed);
+    if (CurProfile->AST->getPool().kind(E) == ExprKind::For) {
+        // every exit ended one trip through the header, the other trips went
+        // around the back-edge. The counters are read while they change.
+        First -= std::min(First, Second);
+    }
+    if (First || Second)
+        Br->setMetadata(LLVMContext::MD_prof, branchWeights(First, Second));
+}
+
+void setProfileSummary(Module &M) {
+    std::vector<uint64_t> Counts;
+    uint64_t MaxFunctionCount = 0;
+    uint32_t NumFunctions = 0;
+    {
+        std::lock_guard<std::mutex> Guard(ProfilesMutex);
+        for (auto &Entry : Profiles) {
+            FunctionProfile &P = *Entry.second;
+            for (unsigned i = 0; i < P.NumCounts; ++i)
+                Counts.push_back(P.Counts[i].load(std::memory_order_relaxed));
+            // counter 0 counts the calls
+            MaxFunctionCount = std::max(MaxFunctionCount,
+                                        Counts[Counts.size() - P.NumCounts]);
+            ++NumFunctions;
+        }
+    }
+    std::sort(Counts.begin(), Counts.end(), std::greater<uint64_t>());
+    uint64_t Total = 0;
+    for (uint64_t C : Counts)
+        Total += C;
+    if (!Total)
+        return;
+
+    // smallest count among the hottest ones that make up each percentile of
+    // all counts, the way the profile readers summarize their data
+    SummaryEntryVector Detailed;
+    size_t Idx = 0;
+    uint64_t Covered = 0;
+    for (uint32_t Cutoff : ProfileSummaryBuilder::DefaultCutoffs) {
+        uint64_t Needed = Total * ((double)Cutoff / ProfileSummary::Scale);
+        while (Idx < Counts.size() && Covered < Needed)
+            Covered += Counts[Idx++];
+        Detailed.emplace_back(Cutoff, Counts[Idx ? Idx - 1 : 0], Idx);
+    }
+
+    ProfileSummary PS(ProfileSummary::PSK_Instr, Detailed, Total, Counts[0],
+                      Counts[0], MaxFunctionCount, Counts.size(),
+                      NumFunctions);
+    M.setProfileSummary(PS.getMD(M.getContext()), ProfileSummary::PSK_Instr);
+}
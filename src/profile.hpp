@@ -0,0 +1,88 @@
+#ifndef my_profile_hpp
+#define my_profile_hpp
+
+#include <atomic>
+#include <memory>
+
+#include "ast.hpp"
+
+/**
+ * @struct FunctionProfile
+ * @brief Counters of a definition compiled with instrumentation, and the
+ * address of its re-optimized code once it has been recompiled
+ *
+ */
+struct FunctionProfile {
+    std::shared_ptr<FunctionAST> AST;
+
+    // index of the first of the two counters of every 'if' (then, else) and
+    // 'for' (loop header, loop exit) in the body
+    llvm::DenseMap<ExprRef, unsigned> Branches;
+
+    // updated by the instrumented code. Counter 0 counts calls.
+    std::unique_ptr<std::atomic<uint64_t>[]> Counts;
+    unsigned NumCounts = 0;
+
+    // instrumented code forwards every call here once it is set
+    std::atomic<void*> Optimized{nullptr};
+    std::atomic<bool> Queued{false}; // handed to TierUp() already
+};
+
+/**
+ * @brief How the profile of the function being generated is used
+ */
+enum class ProfileMode {
+    Instrument, // count calls and edges, and tier up once hot
+    Apply       // annotate branch weights and the entry count
+};
+
+/**
+ * @class ProfileCodegen
+ * @brief Makes codegen on the calling thread instrument or apply a profile
+ * for as long as it lives. Does nothing for a null profile.
+ *
+ */
+class ProfileCodegen {
+public:
+    ProfileCodegen(FunctionProfile* Profile, ProfileMode Mode);
+    ~ProfileCodegen();
+};
+
+/**
+ * @brief Create the profile of a definition, unless one exists for its name
+ * already. Counters are laid out right away, so codegen may use the profile
+ * on any thread.
+ */
+void addProfiledDefinition(std::shared_ptr<FunctionAST> FnAST);
+
+/**
+ * @brief Profile of a definition, or null if it has none
+ */
+FunctionProfile* getProfile(Symbol Name);
+
+/**
+ * @brief Emit the start of a function: with instrumentation, forward calls
+ * to the optimized code once it exists and count the call otherwise. With an
+ * applied profile, set the entry count.
+ */
+void profileFunctionEntry(llvm::Function* F);
+
+/**
+ * @brief Count an edge of an 'if' (0: then, 1: else) or 'for' (0: loop
+ * header, 1: loop exit) at the current insertion point
+ */
+void profileEdge(ExprRef E, unsigned Edge);
+
+/**
+ * @brief Attach the counted branch weights to the conditional branch of an
+ * 'if' or to the back-edge branch of a 'for'
+ */
+void profileBranch(llvm::BranchInst* Br, ExprRef E);
+
+/**
+ * @brief Attach a summary of all profiles collected so far to a module, so
+ * that the optimizer can tell hot code from cold
+ */
+void setProfileSummary(llvm::Module &M);
+
+#endif
@@ -0,0 +1,55 @@
+#include <string>
+#include "symbol.hpp"
+
+SymbolTable Symbols;
+
+SymbolTable::SymbolTable() {
+    // must follow the order of PredefinedSymbol
+    static const char* const Predefined[] = {
+        "def", "extern", "as", "if", "then", "else", "for", "do",
+        "binary", "unary", "parallel", "var", "in", "__anon_expr", "array",
+        "len", "free", "fast", "versioned"
+    };
+    static_assert(sizeof(Predefined) / sizeof(Predefined[0]) ==
+                  num_predefined_symbols, "predefined symbol table mismatch");
+
+    for (const char* Name : Predefined)
+        intern(Name);
+
+    for (auto &Row : OpSymbols)
+        for (auto &S : Row)
+            S = ~0u;
+}
+
+Symbol SymbolTable::intern(llvm::StringRef Name) {
+    {
+        std::shared_lock<std::shared_mutex> Guard(Lock);
+        auto It = Map.find(Name);
+        if (It != Map.end())
+            return It->second;
+    }
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    auto [It, Inserted] = Map.try_emplace(Name, NumNames);
+    if (Inserted) {
+        auto [Chunk, Index] = locate(NumNames++);
+        if (!Names[Chunk])
+            Names[Chunk] = std::make_unique<llvm::StringRef[]>(64u << Chunk);
+        Names[Chunk][Index] = It->getKey();
+    }
+    return It->second;
+}
+
+Symbol SymbolTable::opSymbol(bool Binary, char Op) {
+    Symbol &S = OpSymbols[Binary][(unsigned char)Op];
+    {
+        std::shared_lock<std::shared_mutex> Guard(Lock);
+        if (S != ~0u)
+            return S;
+    }
+    std::string Name = Binary ? "binary" : "unary";
+    Name += Op;
+    Symbol Sym = intern(Name);
+
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    return S = Sym;
+}
@@ -0,0 +1,173 @@
+#ifndef my_symbol_hpp
+#define my_symbol_hpp
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MathExtras.h"
+
+/**
+ * @brief Compact handle for an interned identifier. Two symbols are equal iff
+ * their spellings are equal.
+ */
+using Symbol = uint32_t;
+
+/**
+ * @brief Symbols that are interned up front. The keywords come first and in
+ * the same order as their tokens so the lexer can map them with a table.
+ */
+enum PredefinedSymbol : Symbol {
+    sym_def,
+    sym_extern,
+    sym_as,
+    sym_if,
+    sym_then,
+    sym_else,
+    sym_for,
+    sym_do,
+    sym_binary,
+    sym_unary,
+    sym_parallel,
+    sym_var,
+    sym_in,
+    sym_last_keyword = sym_in,
+
+    sym_anon_expr,
+
+    // builtin array functions, unless the program defines its own
+    sym_array,
+    sym_len,
+    sym_free,
+
+    // annotations of definitions: compiled with fast math, and compiled for
+    // several CPUs
+    sym_fast,
+    sym_versioned,
+    num_predefined_symbols
+};
+
+/**
+ * @class SymbolTable
+ * @brief Interner that maps identifier spellings to dense integer ids. The
+ * parser interns while definitions are generated on other threads, so
+ * interning is locked. A spelling is stored before its symbol is handed out
+ * and never moves afterwards, so looking it up takes no lock.
+ *
+ */
+class SymbolTable {
+    llvm::StringMap<Symbol> Map;
+    // spellings by symbol, in chunks that are never reallocated: chunk K
+    // holds 64 << K of them
+    std::unique_ptr<llvm::StringRef[]> Names[26];
+    Symbol NumNames = 0;
+    Symbol OpSymbols[2][256];
+    std::shared_mutex Lock;
+
+    // chunk of Names holding a symbol, and its index there
+    static std::pair<unsigned, unsigned> locate(Symbol S) {
+        unsigned K = llvm::Log2_32(S + 64) - 6;
+        return {K, S + 64 - (64u << K)};
+    }
+
+public:
+    SymbolTable();
+
+    /**
+     * @brief Get the symbol for a spelling, interning it if it is new
+     *
+     * @param Name Spelling of the identifier
+     * @return Symbol id, stable for the lifetime of the table
+     */
+    Symbol intern(llvm::StringRef Name);
+
+    /**
+     * @brief Get the spelling of a symbol. The reference stays valid for the
+     * lifetime of the table.
+     */
+    llvm::StringRef name(Symbol S) const {
+        auto [Chunk, Index] = locate(S);
+        return Names[Chunk][Index];
+    }
+
+    /**
+     * @brief Get the symbol naming a user-defined operator function, i.e.
+     * "unary" or "binary" followed by the operator character
+     *
+     * @param Binary True for binary operators, false for unary ones
+     * @param Op Operator character
+     */
+    Symbol opSymbol(bool Binary, char Op);
+};
+
+/**
+ * @class ScopedMap
+ * @brief Flat hash table with nested scopes. Bindings made inside a scope are
+ * undone when the scope is popped.
+ *
+ */
+template <typename K, typename T>
+class ScopedMap {
+    // a binding undone by popScope: the key, and the value it had if any
+    struct Undo {
+        K Key;
+        T Old;
+        bool WasBound;
+    };
+
+    llvm::DenseMap<K, T> Map;
+    std::vector<Undo> Shadowed;
+    std::vector<size_t> Scopes;
+
+public:
+    /**
+     * @brief Get the value bound to a key, or a default-constructed value
+     */
+    T lookup(K S) const { return Map.lookup(S); }
+
+    /**
+     * @brief Bind a key in the innermost scope
+     */
+    void insert(K S, T Val) {
+        auto [It, Inserted] = Map.try_emplace(S);
+        if (!Scopes.empty())
+            Shadowed.push_back({S, It->second, !Inserted});
+        It->second = Val;
+    }
+
+    void pushScope() { Scopes.push_back(Shadowed.size()); }
+
+    void popScope() {
+        size_t Mark = Scopes.back();
+        Scopes.pop_back();
+        while (Shadowed.size() > Mark) {
+            Undo &U = Shadowed.back();
+            if (U.WasBound)
+                Map[U.Key] = U.Old;
+            else
+                Map.erase(U.Key);
+            Shadowed.pop_back();
+        }
+    }
+
+    void clear() {
+        Map.clear();
+        Shadowed.clear();
+        Scopes.clear();
+    }
+};
+
+/**
+ * @brief Scoped table keyed by symbol, e.g. variable bindings
+ */
+template <typename T>
+using ScopedSymbolMap = ScopedMap<Symbol, T>;
+
+extern SymbolTable Symbols;
+
+#endif
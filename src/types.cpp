@@ -0,0 +1,236 @@
+#include "types.hpp"
+#include <cmath>
+#include <mutex>
+
+using namespace llvm;
+
+// definitions by name, shared by all threads
+static DenseMap<Symbol, std::shared_ptr<FunctionAST>> Definitions;
+static std::mutex DefinitionsMutex;
+
+namespace {
+
+/**
+ * @struct IntBound
+ * @brief Bound on the magnitude of a whole number: |v| < 2^Bits. Names
+ * without a binding look up as a default IntBound, which is no whole number.
+ *
+ */
+struct IntBound {
+    static constexpr unsigned NotInt = 64;
+    unsigned Bits = NotInt;
+
+    bool isInt() const { return Bits < NotInt; }
+
+    // values held in an i64 may not reach 2^63
+    static IntBound get(unsigned Bits) {
+        return {Bits < NotInt ? Bits : NotInt};
+    }
+
+    ValueType getType() const {
+        return Bits <= 53 ? ValueType::Int
+             : isInt()    ? ValueType::WideInt
+                          : ValueType::Double;
+    }
+};
+
+/**
+ * @class TypeInference
+ * @brief Walks a body once, binding variables in scope to the bounds of
+ * their values. Whole numbers come from whole constants, loop counters
+ * counting in whole steps from a whole number, array lengths, comparisons,
+ * and sums and differences of Int values. A sum that may reach 2^53 is
+ * WideInt, and so is not added to further: a double would round it, and
+ * every later sum would have to round the same way. Loop counters are taken
+ * to stay below 2^53, past which a double one stops counting. Products and
+ * quotients round, and other calls, array elements and 'var' variables can
+ * hold anything, so those are Double.
+ *
+ */
+class TypeInference {
+    const ExprPool &Pool;
+    std::vector<ValueType> Types;
+    std::vector<IntBound> Bounds;
+    BitVector Seen;
+    ScopedSymbolMap<IntBound> Scope;
+    bool BuiltinLen;
+
+    IntBound compute(ExprRef E);
+
+public:
+    TypeInference(const ExprPool &Pool, bool BuiltinLen)
+        : Pool(Pool), Types(Pool.size(), ValueType::Double),
+          Bounds(Pool.size()), Seen(Pool.size()), BuiltinLen(BuiltinLen) {}
+
+    void bind(Symbol Name, IntBound Bound) { Scope.insert(Name, Bound); }
+    IntBound visit(ExprRef E);
+    std::vector<ValueType> takeTypes() { return std::move(Types); }
+};
+
+} // namespace
+
+IntBound TypeInference::visit(ExprRef E) {
+    IntBound Bound = compute(E);
+
+    // a hash-consed node can be reached from scopes binding its variables
+    // differently, and keeps the bound that holds in all of them
+    if (Seen.test(E))
+        Bound.Bits = std::max(Bound.Bits, Bounds[E].Bits);
+    Seen.set(E);
+    Bounds[E] = Bound;
+    Types[E] = Bound.getType();
+    return Bound;
+}
+
+/**
+ * @brief Bound of a whole constant below 2^53, the others are Double
+ */
+static IntBound getConstantBound(double Val) {
+    if (std::trunc(Val) != Val || std::fabs(Val) >= 0x1p53)
+        return {};
+    return IntBound::get(Val == 0 ? 0 : std::ilogb(Val) + 1);
+}
+
+IntBound TypeInference::compute(ExprRef E) {
+    constexpr IntBound Double;
+    switch (Pool.kind(E)) {
+        case ExprKind::Number:
+            return getConstantBound(Pool.number(E));
+        case ExprKind::Variable:
+            return Scope.lookup(Pool.symbol(E));
+        case ExprKind::Unary:
+            visit(Pool.operand(E, 0));
+            return Double;
+        case ExprKind::Binary: {
+            IntBound L = visit(Pool.operand(E, 0));
+            IntBound R = visit(Pool.operand(E, 1));
+            switch (Pool.oper(E)) {
+                case '+':
+                case '-':
+                    if (L.getType() != ValueType::Int ||
+                        R.getType() != ValueType::Int)
+                        return Double;
+                    return IntBound::get(std::max(L.Bits, R.Bits) + 1);
+                case '<':
+                    return IntBound::get(1);
+                default:
+                    return Double;
+            }
+        }
+        case ExprKind::Call:
+            for (ExprRef Arg : Pool.operands(E))
+                visit(Arg);
+            // arrays have fewer than 2^53 elements
+            if (BuiltinLen && Pool.symbol(E) == sym_len &&
+                Pool.operands(E).size() == 1)
+                return IntBound::get(53);
+            return Double;
+        case ExprKind::If: {
+            visit(Pool.operand(E, 0));
+            IntBound Then = visit(Pool.operand(E, 1));
+            IntBound Else = visit(Pool.operand(E, 2));
+            return IntBound::get(std::max(Then.Bits, Else.Bits));
+        }
+        case ExprKind::For:
+        case ExprKind::ParallelFor: {
+            ExprRef Step = Pool.operand(E, 2);
+            bool Parallel = Pool.kind(E) == ExprKind::ParallelFor;
+            IntBound Start = visit(Pool.operand(E, 0));
+            // a WideInt start is below 2^53 like the counter it starts
+            bool Counts = Start.isInt() &&
+                          (!Step || (Pool.kind(Step) == ExprKind::Number &&
+                                     getConstantBound(Pool.number(Step))
+                                             .isInt()));
+            IntBound Var = Counts ? IntBound::get(53) : Double;
+
+            // the bounds of a parallel loop are evaluated before it starts
+            if (Parallel) {
+                visit(Pool.operand(E, 1));
+                if (Step)
+                    visit(Step);
+            }
+            Scope.pushScope();
+            bind(Pool.symbol(E), Var);
+            if (!Parallel) {
+                visit(Pool.operand(E, 1));
+                if (Step)
+                    visit(Step);
+            }
+            visit(Pool.operand(E, 3));
+            Scope.popScope();
+
+            // loops evaluate to 0.0
+            return IntBound::get(0);
+        }
+        case ExprKind::Index:
+            visit(Pool.operand(E, 0));
+            visit(Pool.operand(E, 1));
+            return Double;
+        case ExprKind::Store:
+            visit(Pool.operand(E, 0));
+            visit(Pool.operand(E, 1));
+            return visit(Pool.operand(E, 2));
+        case ExprKind::Var: {
+            visit(Pool.operand(E, 0));
+            Scope.pushScope();
+            bind(Pool.symbol(E), Double);
+            IntBound Body = visit(Pool.operand(E, 1));
+            Scope.popScope();
+            return Body;
+        }
+        case ExprKind::Assign:
+            return visit(Pool.operand(E, 0));
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+std::vector<ValueType> inferTypes(const ExprPool &Pool, ExprRef Body,
+                                  ArrayRef<Symbol> Args,
+                                  ArrayRef<ValueType> ArgTypes,
+                                  bool BuiltinLen) {
+    // the integer arguments of clones are below 2^53
+    TypeInference TI(Pool, BuiltinLen);
+    for (unsigned i = 0; i < Args.size(); ++i)
+        TI.bind(Args[i], ArgTypes[i] == ValueType::Double ||
+                                 Pool.isMutable(Args[i])
+                         ? IntBound()
+                         : IntBound::get(53));
+    TI.visit(Body);
+    return TI.takeTypes();
+}
+
+void addSpecializableDefinition(std::shared_ptr<FunctionAST> FnAST) {
+    Symbol Name = FnAST->getProto().getName();
+    std::lock_guard<std::mutex> Guard(DefinitionsMutex);
+    // the JIT does not take a redefinition either
+    Definitions.try_emplace(Name, std::move(FnAST));
+}
+
+std::shared_ptr<FunctionAST> getSpecializableDefinition(Symbol Name) {
+    std::lock_guard<std::mutex> Guard(DefinitionsMutex);
+    return Definitions.lookup(Name);
+}
+
+std::vector<ValueType> getSpecialization(const FunctionAST &FnAST,
+                                         ArrayRef<ValueType> ArgTypes) {
+    const std::vector<Symbol> &Args = FnAST.getProto().getArgs();
+    std::vector<ValueType> Types(ArgTypes.begin(), ArgTypes.end());
+    bool AnyInt = false;
+    for (unsigned i = 0; i < Types.size(); ++i) {
+        if (FnAST.getPool().isMutable(Args[i]))
+            Types[i] = ValueType::Double;
+        else if (Types[i] == ValueType::WideInt)
+            Types[i] = ValueType::Int;
+        AnyInt |= Types[i] == ValueType::Int;
+    }
+    if (!AnyInt)
+        Types.clear();
+    return Types;
+}
+
+std::string getSpecializedName(Symbol Name, ArrayRef<ValueType> ArgTypes) {
+    std::string Result = Symbols.name(Name).str() + ".";
+    for (ValueType Type : ArgTypes)
+        Result += Type == ValueType::Int ? 'i' : 'd';
+    return Result;
+}
@@ -0,0 +1,66 @@
+#ifndef my_types_hpp
+#define my_types_hpp
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.hpp"
+
+/**
+ * @brief What is known about the value of an expression. Every value is a
+ * double, but Int ones are proven to be whole numbers below 2^53 in
+ * magnitude, where i64 arithmetic gives the same results, so codegen carries
+ * them in i64 registers. A WideInt is a sum of two Int values that may reach
+ * 2^54. It is computed as a double like any other value, and only passed to
+ * a specialized clone as an integer after checking that it is below 2^53.
+ */
+enum class ValueType : uint8_t { Double, Int, WideInt };
+
+/**
+ * @brief Infer the type of every node of a function body
+ *
+ * @param Pool Pool holding the body
+ * @param Body Body of the function
+ * @param Args Argument names
+ * @param ArgTypes Types of the arguments, all Double for the generic version
+ * @param BuiltinLen Whether len() is the builtin, which no program
+ * definition or extern overrides
+ * @return std::vector<ValueType> Type of each node, indexed by ExprRef
+ */
+std::vector<ValueType> inferTypes(const ExprPool &Pool, ExprRef Body,
+                                  llvm::ArrayRef<Symbol> Args,
+                                  llvm::ArrayRef<ValueType> ArgTypes,
+                                  bool BuiltinLen);
+
+/**
+ * @brief Remember a definition, so that calls with integer arguments can be
+ * given a clone specialized to them. May be called while other threads
+ * generate code.
+ */
+void addSpecializableDefinition(std::shared_ptr<FunctionAST> FnAST);
+
+/**
+ * @brief Definition a call to Name can be specialized from, if any
+ */
+std::shared_ptr<FunctionAST> getSpecializableDefinition(Symbol Name);
+
+/**
+ * @brief Argument types a definition is specialized to when called with
+ * arguments of the given types. Arguments that are assigned to stay Double,
+ * and WideInt ones are passed as Int once they are checked.
+ *
+ * @return std::vector<ValueType> The types, or an empty vector if they are
+ * all Double and the generic version is used
+ */
+std::vector<ValueType> getSpecialization(const FunctionAST &FnAST,
+                                         llvm::ArrayRef<ValueType> ArgTypes);
+
+/**
+ * @brief Name of the clone of a function specialized to ArgTypes, e.g.
+ * "fib.i" or "add.di"
+ */
+std::string getSpecializedName(Symbol Name,
+                               llvm::ArrayRef<ValueType> ArgTypes);
+
+#endif